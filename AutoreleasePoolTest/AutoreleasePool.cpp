@@ -0,0 +1,69 @@
+//
+//  AutoreleasePool.cpp
+//  AutoreleasePoolTest
+//
+//  Created by king on 2023/8/16.
+//
+
+#include "AutoreleasePool.h"
+
+// Settings from environment variables
+#define OPTION(var, env, help) bool var = false;
+#include "objc-env.h"
+#undef OPTION
+
+// Read the settings above from the environment. Only "YES" turns an
+// option on, as in the runtime.
+void environ_init(void) {
+#define OPTION(var, env, help)                   \
+    if (const char *value = getenv(#env)) {      \
+        var = (0 == strcmp(value, "YES"));       \
+    }
+#include "objc-env.h"
+#undef OPTION
+}
+
+const std::array<AutoreleasePoolPage::EntryPoints, AutoreleasePoolPage::OptCombinations> AutoreleasePoolPage::entryPointTable =
+    AutoreleasePoolPage::makeEntryPointTable(std::make_index_sequence<AutoreleasePoolPage::OptCombinations>());
+AutoreleasePoolPage::EntryPoints AutoreleasePoolPage::entryPoints =
+    AutoreleasePoolPage::entryPointsFor<AutoreleasePoolPage::OptDefaults>();
+
+AutoreleasePoolRetentionPolicy AutoreleasePoolPage::retention = {AutoreleasePoolRetentionPolicy::Hysteresis, 0};
+size_t AutoreleasePoolPage::coalescedDrainThreshold = 0;
+PageStack<AutoreleasePoolPage::SIZE> AutoreleasePoolPage::pageCache;
+std::mutex AutoreleasePoolPage::registryLock;
+AutoreleasePoolThreadState *AutoreleasePoolPage::registry = nil;
+AutoreleaseSampleMode AutoreleasePoolPage::sampleMode = AutoreleaseSampleMode::Off;
+uint64_t AutoreleasePoolPage::samplePeriod = 0;
+AutoreleaseSampleTable *AutoreleasePoolPage::exitedSamples = nil;
+#if TRACK_AUTORELEASEPOOL_SCOPES
+AutoreleasePoolScopeStats *AutoreleasePoolPage::exitedScopeStats = nil;
+#endif
+std::atomic<uint32_t> AutoreleasePoolPage::threadsWithPendingDrain{0};
+std::atomic<uint32_t> AutoreleasePoolPage::threadsWithTrimRequest{0};
+std::atomic<uint64_t> AutoreleasePoolPage::globalEpoch{1};
+std::atomic<uint32_t> AutoreleasePoolPage::epochThreads{0};
+std::vector<AutoreleasePoolThreadState::RetiredNode> AutoreleasePoolPage::orphanedNodes;
+std::atomic<bool> AutoreleasePoolPage::hasOrphanedNodes{false};
+unsigned AutoreleasePoolPage::options = AutoreleasePoolPage::OptDefaults;
+AutoreleasePoolPageBudget AutoreleasePoolPage::pageBudget = {0, 0, nil};
+ShardedCounter AutoreleasePoolPage::pagesInUse;
+std::atomic<bool> AutoreleasePoolPage::overProcessBudget{false};
+
+// C interface
+
+void *autoreleasePoolPush(void) {
+    return AutoreleasePoolPage::push();
+}
+
+void autoreleasePoolPop(void *token) {
+    AutoreleasePoolPage::pop(token);
+}
+
+id autorelease(id obj) {
+    return AutoreleasePoolPage::autorelease(obj);
+}
+
+__attribute__((constructor)) static void autoreleasePoolInit(void) {
+    AutoreleasePoolPage::init();
+}
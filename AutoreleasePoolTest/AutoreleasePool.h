@@ -0,0 +1,48 @@
+//
+//  AutoreleasePool.h
+//  AutoreleasePoolTest
+//
+//  Created by king on 2023/8/16.
+//
+
+#ifndef AutoreleasePool_h
+#define AutoreleasePool_h
+
+#include <objc/objc.h>
+
+#define AUTORELEASEPOOL_EXPORT __attribute__((visibility("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The pool is set up when the library loads.
+
+AUTORELEASEPOOL_EXPORT void *autoreleasePoolPush(void);
+AUTORELEASEPOOL_EXPORT void autoreleasePoolPop(void *token);
+AUTORELEASEPOOL_EXPORT id autorelease(id obj);
+
+#ifdef __cplusplus
+}
+
+#include "AutoreleasePoolPage.h"
+
+// autorelease() with the common case inlined into the caller.
+// The library and its callers must be built with the same pool settings.
+static inline id autoreleaseInline(id obj) {
+    return AutoreleasePoolPage::autoreleaseInline(obj);
+}
+
+// Move a smart pointer's ownership into the current pool.
+template <typename T, typename D>
+static inline typename std::unique_ptr<T, D>::pointer autorelease(std::unique_ptr<T, D> &&p) {
+    return AutoreleasePoolPage::autorelease(std::move(p));
+}
+
+template <typename T>
+static inline T *autorelease(std::shared_ptr<T> &&p) {
+    return AutoreleasePoolPage::autorelease(std::move(p));
+}
+#endif
+
+#endif /* AutoreleasePool_h */
@@ -0,0 +1,3745 @@
+//
+//  AutoreleasePoolPage.h
+//  AutoreleasePoolTest
+//
+//  Created by king on 2023/8/16.
+//
+
+#ifndef AutoreleasePoolPage_h
+#define AutoreleasePoolPage_h
+
+#include <assert.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <iostream>
+#include <memory>
+#include <mach/vm_param.h>
+#include <mutex>
+#include <malloc/malloc.h>
+#include <new>
+#include <objc/objc.h>
+#include <pthread.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "pthread_machdep.h"
+#include "tsd_private.h"
+
+// Settings from environment variables
+#define OPTION(var, env, help) extern bool var;
+#include "objc-env.h"
+#undef OPTION
+
+void environ_init(void);
+
+#ifndef C_ASSERT
+#if __has_feature(cxx_static_assert)
+#define C_ASSERT(expr) static_assert(expr, "(" #expr ")!")
+#elif __has_feature(c_static_assert)
+#define C_ASSERT(expr) _Static_assert(expr, "(" #expr ")!")
+#else
+#define C_ASSERT(expr)
+#endif
+#endif
+
+// Make ASSERT work when objc-private.h hasn't been included.
+#ifndef ASSERT
+#define ASSERT(x) assert(x)
+#endif
+
+// Define AUTORELEASEPOOL_SPLIT_LAYOUT to keep coalescing counts in an
+// array of their own at the end of each page instead of in the top bits
+// of each entry. Entries then hold whole pointers, so coalescing works
+// with any address width, and comparisons and drains see plain pointers.
+// 32-bit pointers have no spare bits, so ILP32 always uses it.
+#ifndef AUTORELEASEPOOL_SPLIT_LAYOUT
+#if !__LP64__
+#define AUTORELEASEPOOL_SPLIT_LAYOUT 1
+#else
+#define AUTORELEASEPOOL_SPLIT_LAYOUT 0
+#endif
+#endif
+
+// Define SUPPORT_AUTORELEASEPOOL_DEDDUP_PTRS to combine consecutive pointers to the same object in autorelease pools
+#if !__LP64__ && !AUTORELEASEPOOL_SPLIT_LAYOUT
+#define SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS 0
+#else
+#define SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS 1
+#endif
+
+// Define LOG_AUTORELEASEPOOL=0 to silence the logging of every pool
+// operation, e.g. when benchmarking.
+#ifndef LOG_AUTORELEASEPOOL
+#define LOG_AUTORELEASEPOOL 1
+#endif
+
+// Define TRACK_AUTORELEASEPOOL_SCOPES to record per-thread histograms of
+// pool scope lifetimes, sizes and drain times. Without it none of the
+// timing code is compiled in.
+#ifndef TRACK_AUTORELEASEPOOL_SCOPES
+#define TRACK_AUTORELEASEPOOL_SCOPES 0
+#endif
+
+// Define GUARD_AUTORELEASEPOOL to follow every page with an inaccessible
+// guard page and, when built with AddressSanitizer, to poison the slots
+// that don't hold entries. Overflows and reads through stale tokens fault
+// without the system call per operation that PROTECT_AUTORELEASEPOOL
+// costs; only allocating and freeing a page makes system calls. Guarded
+// pages are mapped with mmap() instead of coming from malloc.
+#ifndef GUARD_AUTORELEASEPOOL
+#define GUARD_AUTORELEASEPOOL 0
+#endif
+
+#if GUARD_AUTORELEASEPOOL
+#include <sys/mman.h>
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer)
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#define AUTORELEASEPOOL_LSAN_ROOTS 1
+#endif
+#endif
+#ifndef AUTORELEASEPOOL_LSAN_ROOTS
+#define AUTORELEASEPOOL_LSAN_ROOTS 0
+#endif
+#ifndef ASAN_POISON_MEMORY_REGION
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+
+// Define SUPPORT_RETURN_AUTORELEASE=0 to make autoreleaseReturnValue()
+// a plain autorelease. The handoff to the caller needs a thread key.
+#ifndef SUPPORT_RETURN_AUTORELEASE
+#if defined(__PTK_FRAMEWORK_OBJC_KEY4)
+#define SUPPORT_RETURN_AUTORELEASE 1
+#else
+#define SUPPORT_RETURN_AUTORELEASE 0
+#endif
+#endif
+
+// Thread keys reserved by libc for our use.
+#if defined(__PTK_FRAMEWORK_OBJC_KEY0)
+#define SUPPORT_DIRECT_THREAD_KEYS 1
+#define TLS_DIRECT_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY0)
+#define SYNC_DATA_DIRECT_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY1)
+#define SYNC_COUNT_DIRECT_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY2)
+#define AUTORELEASE_POOL_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY3)
+#if SUPPORT_RETURN_AUTORELEASE
+#define RETURN_DISPOSITION_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY4)
+#endif
+#define AUTORELEASE_POOL_STATE_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY5)
+#else
+#define SUPPORT_DIRECT_THREAD_KEYS 0
+#endif
+
+#define fastpath(x) (__builtin_expect(bool(x), 1))
+#define slowpath(x) (__builtin_expect(bool(x), 0))
+
+// Internal data types
+
+typedef pthread_t objc_thread_t;
+
+static __inline int thread_equal(objc_thread_t t1, objc_thread_t t2) {
+    return pthread_equal(t1, t2);
+}
+
+typedef pthread_key_t tls_key_t;
+
+static inline tls_key_t tls_create(void (*dtor)(void *)) {
+    tls_key_t k;
+    pthread_key_create(&k, dtor);
+    return k;
+}
+static inline void *tls_get(tls_key_t k) {
+    return pthread_getspecific(k);
+}
+static inline void tls_set(tls_key_t k, void *value) {
+    pthread_setspecific(k, value);
+}
+
+#if SUPPORT_DIRECT_THREAD_KEYS
+
+static inline bool is_valid_direct_key(tls_key_t k) {
+    return (k == SYNC_DATA_DIRECT_KEY || k == SYNC_COUNT_DIRECT_KEY || k == AUTORELEASE_POOL_KEY || k == AUTORELEASE_POOL_STATE_KEY || k == _PTHREAD_TSD_SLOT_PTHREAD_SELF
+#if SUPPORT_RETURN_AUTORELEASE
+            || k == RETURN_DISPOSITION_KEY
+#endif
+    );
+}
+
+static inline void *tls_get_direct(tls_key_t k) {
+    ASSERT(is_valid_direct_key(k));
+
+    if (_pthread_has_direct_tsd()) {
+        return _pthread_getspecific_direct(k);
+    } else {
+        return pthread_getspecific(k);
+    }
+}
+static inline void tls_set_direct(tls_key_t k, void *value) {
+    ASSERT(is_valid_direct_key(k));
+
+    if (_pthread_has_direct_tsd()) {
+        _pthread_setspecific_direct(k, value);
+    } else {
+        pthread_setspecific(k, value);
+    }
+}
+
+__attribute__((const)) static inline pthread_t objc_thread_self() {
+    return (pthread_t)tls_get_direct(_PTHREAD_TSD_SLOT_PTHREAD_SELF);
+}
+#else
+__attribute__((const)) static inline pthread_t objc_thread_self() {
+    return pthread_self();
+}
+#endif  // SUPPORT_DIRECT_THREAD_KEYS
+
+// Tagged pointers
+// Small immutable values are packed into the pointer itself. Objects
+// are at least pointer-aligned, so bit 0 marks a tagged pointer, the
+// next three bits hold the tag and the remaining bits the payload.
+// Tagged pointers are never retained, released or added to a pool.
+
+enum objc_tag_index_t : uint16_t {
+    OBJC_TAG_NSString = 2,
+    OBJC_TAG_NSNumber = 3,
+};
+
+#define _OBJC_TAG_MASK 1UL
+#define _OBJC_TAG_INDEX_SHIFT 1
+#define _OBJC_TAG_INDEX_MASK 0x7UL
+#define _OBJC_TAG_PAYLOAD_RSHIFT 4
+#define _OBJC_TAG_PAYLOAD_BITS (sizeof(uintptr_t) * 8 - _OBJC_TAG_PAYLOAD_RSHIFT)
+
+// Short strings keep their length in the low 4 payload bits and one
+// character per byte above it: 7 characters on LP64, 3 on ILP32.
+#define _OBJC_TAG_STRING_MAX ((_OBJC_TAG_PAYLOAD_BITS - 4) / 8)
+
+static inline bool _objc_isTaggedPointer(const void *ptr) {
+    return ((uintptr_t)ptr & _OBJC_TAG_MASK) == _OBJC_TAG_MASK;
+}
+
+static inline bool _objc_isTaggedPointerOrNil(const void *ptr) {
+    return !ptr || _objc_isTaggedPointer(ptr);
+}
+
+static inline void *_objc_makeTaggedPointer(objc_tag_index_t tag, uintptr_t value) {
+    return (void *)((value << _OBJC_TAG_PAYLOAD_RSHIFT) | ((uintptr_t)tag << _OBJC_TAG_INDEX_SHIFT) | _OBJC_TAG_MASK);
+}
+
+static inline objc_tag_index_t _objc_getTaggedPointerTag(const void *ptr) {
+    ASSERT(_objc_isTaggedPointer(ptr));
+    return (objc_tag_index_t)(((uintptr_t)ptr >> _OBJC_TAG_INDEX_SHIFT) & _OBJC_TAG_INDEX_MASK);
+}
+
+static inline uintptr_t _objc_getTaggedPointerValue(const void *ptr) {
+    ASSERT(_objc_isTaggedPointer(ptr));
+    return (uintptr_t)ptr >> _OBJC_TAG_PAYLOAD_RSHIFT;
+}
+
+static inline intptr_t _objc_getTaggedPointerSignedValue(const void *ptr) {
+    ASSERT(_objc_isTaggedPointer(ptr));
+    return (intptr_t)ptr >> _OBJC_TAG_PAYLOAD_RSHIFT;
+}
+
+// Returns nil if value doesn't fit in the payload.
+static inline id _objc_taggedNumber(intptr_t value) {
+    intptr_t max = ((intptr_t)1 << (_OBJC_TAG_PAYLOAD_BITS - 1)) - 1;
+    if (value > max || value < -max - 1) return nil;
+    return (id)_objc_makeTaggedPointer(OBJC_TAG_NSNumber, (uintptr_t)value);
+}
+
+static inline intptr_t _objc_taggedNumberValue(id obj) {
+    ASSERT(_objc_getTaggedPointerTag(obj) == OBJC_TAG_NSNumber);
+    return _objc_getTaggedPointerSignedValue(obj);
+}
+
+// Returns nil if the string is longer than _OBJC_TAG_STRING_MAX.
+static inline id _objc_taggedString(const char *str, size_t len) {
+    if (len > _OBJC_TAG_STRING_MAX) return nil;
+    uintptr_t payload = len;
+    for (size_t i = 0; i < len; i++) {
+        payload |= (uintptr_t)(unsigned char)str[i] << (4 + 8 * i);
+    }
+    return (id)_objc_makeTaggedPointer(OBJC_TAG_NSString, payload);
+}
+
+static inline std::string _objc_taggedStringValue(id obj) {
+    ASSERT(_objc_getTaggedPointerTag(obj) == OBJC_TAG_NSString);
+    uintptr_t payload = _objc_getTaggedPointerValue(obj);
+    std::string result(payload & 0xf, '\0');
+    for (size_t i = 0; i < result.size(); i++) {
+        result[i] = (char)(payload >> (4 + 8 * i));
+    }
+    return result;
+}
+
+struct magic_t {
+    static const uint32_t M0 = 0xA1A1A1A1;
+#define M1 "AUTORELEASE!"
+    static const size_t M1_len = 12;
+    uint32_t m[4];
+
+    magic_t() {
+        ASSERT(M1_len == strlen(M1));
+        ASSERT(M1_len == 3 * sizeof(m[1]));
+
+        m[0] = M0;
+        strncpy((char *)&m[1], M1, M1_len);
+    }
+
+    ~magic_t() {
+        // Clear magic before deallocation.
+        // This prevents some false positives in memory debugging tools.
+        // fixme semantically this should be memset_s(), but the
+        // compiler doesn't optimize that at all (rdar://44856676).
+        volatile uint64_t *p = (volatile uint64_t *)m;
+        p[0] = 0;
+        p[1] = 0;
+    }
+
+    bool check() const {
+        return (m[0] == M0 && 0 == strncmp((char *)&m[1], M1, M1_len));
+    }
+
+    bool fastcheck() const {
+#if CHECK_AUTORELEASEPOOL
+        return check();
+#else
+        return (m[0] == M0);
+#endif
+    }
+
+#undef M1
+};
+
+class AutoreleasePoolPage;
+struct AutoreleasePoolPageData {
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS && !AUTORELEASEPOOL_SPLIT_LAYOUT
+    struct AutoreleasePoolEntry {
+        uintptr_t ptr : 48;
+        uintptr_t count : 16;
+
+        static const uintptr_t maxCount = 65535;  // 2^16 - 1
+    };
+    static_assert((AutoreleasePoolEntry){.ptr = MACH_VM_MAX_ADDRESS}.ptr == MACH_VM_MAX_ADDRESS, "MACH_VM_MAX_ADDRESS doesn't fit into AutoreleasePoolEntry::ptr!");
+#endif
+
+    magic_t const magic;
+    __unsafe_unretained id *next;
+    id *const limit;  // end of the slots, which depends on the page's size
+    pthread_t const thread;
+    AutoreleasePoolPage *const parent;
+    AutoreleasePoolPage *child;
+    uint32_t const depth;
+    uint32_t hiwat;
+    uint64_t idleSince;  // ms timestamp of when this page last stopped being hot
+
+    AutoreleasePoolPageData(__unsafe_unretained id *_next, id *_limit, pthread_t _thread, AutoreleasePoolPage *_parent, uint32_t _depth, uint32_t _hiwat)
+        : magic()
+        , next(_next)
+        , limit(_limit)
+        , thread(_thread)
+        , parent(_parent)
+        , child(nil)
+        , depth(_depth)
+        , hiwat(_hiwat)
+        , idleSince(0) {
+    }
+};
+
+// Decides how many empty pages above the hot page survive a pop.
+// Spare pages make the next growth cheap but hold on to memory for
+// as long as the thread lives.
+struct AutoreleasePoolRetentionPolicy {
+    enum Kind : uint32_t {
+        // Kill every child if the page is less than half full,
+        // otherwise keep one empty child. This is the historical behavior.
+        Hysteresis,
+        // Keep at most `limit` empty pages.
+        KeepPages,
+        // Keep empty pages totalling at most `limit` bytes.
+        KeepBytes,
+        // Keep empty pages that stopped being used less than `limit` ms ago.
+        DropIdle,
+    };
+
+    Kind kind;
+    uint64_t limit;
+};
+
+// How much of the work left behind by popIncremental() a later push,
+// pop or autorelease on the same thread may do. Draining stops at
+// whichever limit is hit first; a zero field means no limit.
+struct AutoreleasePoolDrainBudget {
+    size_t entries;
+    uint64_t ns;
+};
+
+enum class AutoreleasePoolBudgetScope {
+    Thread,
+    Process,
+};
+
+// Limits on the memory held by pool pages, in pages of
+// AutoreleasePoolPage::SIZE; larger chunks count as several pages.
+// A zero field means no limit. When a new page takes usage past a
+// limit, `overflow` is called on the allocating thread. It may log,
+// capture a stack or abort; if it returns, the page is used anyway.
+// It isn't called again for that limit until usage has been back
+// within it at a later page allocation.
+struct AutoreleasePoolPageBudget {
+    size_t threadPages;
+    size_t processPages;
+    void (*overflow)(AutoreleasePoolBudgetScope scope, size_t pages, size_t limit);
+};
+
+struct thread_data_t {
+#ifdef __LP64__
+    pthread_t const thread;
+    uint32_t const hiwat;
+    uint32_t const depth;
+#else
+    pthread_t const thread;
+    uint32_t const hiwat;
+    uint32_t const depth;
+    uint32_t padding;
+#endif
+};
+C_ASSERT(sizeof(thread_data_t) == 16);
+
+class RefCounted;
+
+// Objects whose shared count went below zero, waiting for their owner
+// to fold its biased count in. Once the owner has exited, whoever queues
+// an object merges it on the spot.
+// Every live object created by the owner points at its queue, so the
+// queue lives until the owner has exited and the last of those objects
+// is gone. The owner counts the objects it creates and destroys in
+// `ownerObjects` without atomics; `refs` holds OWNER_BIAS for the owner
+// and drops by one for each object destroyed on another thread. The
+// owner folds its count in when it exits.
+struct RefCountMergeQueue {
+    static int64_t const OWNER_BIAS = (int64_t)1 << 62;
+
+    std::mutex lock;
+    std::vector<RefCounted *> objects;
+    std::atomic<bool> pending{false};
+    bool ownerExited = false;
+    int64_t ownerObjects = 0;
+    std::atomic<int64_t> refs{OWNER_BIAS};
+
+    static void dropRefs(RefCountMergeQueue *queue, int64_t n) {
+        if (queue->refs.fetch_sub(n, std::memory_order_acq_rel) == n) delete queue;
+    }
+};
+
+// Intrusive reference count with biased counting. The thread that
+// creates the object keeps its references in a plain counter; only other
+// threads pay for atomic operations, on a separate shared counter.
+// When the owner's count drops to zero it merges into the shared counter,
+// and whichever side brings the merged total to zero deletes the object.
+// A release that takes the shared count below zero queues the object so
+// that the owner merges early. Pool drains run on the owning thread, so
+// draining thread-local objects does no atomic read-modify-writes.
+class RefCounted {
+  public:
+    // Immortal objects ignore retain and release and are never
+    // added to a pool.
+    explicit RefCounted(bool immortal = false)
+        : ownerQueue(localQueue()), biased(1), merged(false), immortal(immortal) {
+        ownerQueue->ownerObjects++;
+    }
+
+    virtual ~RefCounted() {
+        if (ownerQueue == currentQueue()) {
+            ownerQueue->ownerObjects--;
+        } else {
+            RefCountMergeQueue::dropRefs(ownerQueue, 1);
+        }
+    }
+
+    RefCounted(const RefCounted &) = delete;
+    RefCounted &operator=(const RefCounted &) = delete;
+
+    bool isImmortal() const {
+        return immortal;
+    }
+
+    void retain(uintptr_t n = 1) {
+        if (immortal) return;
+        if (ownerQueue == currentQueue() && !merged) {
+            biased += n;
+        } else {
+            shared.fetch_add((int64_t)n * SHARED_ONE, std::memory_order_relaxed);
+        }
+    }
+
+    void release() {
+        releaseN(1);
+    }
+
+    void releaseN(uintptr_t n) {
+        if (immortal) return;
+        RefCountMergeQueue *queue = currentQueue();
+        if (queue == ownerQueue && !merged) {
+            ASSERT(biased >= n);
+            biased -= n;
+            if (biased == 0) mergeFromOwner();
+            if (slowpath(queue->pending.load(std::memory_order_relaxed))) {
+                drainMergeQueue(queue);
+            }
+        } else {
+            releaseShared(n);
+        }
+    }
+
+    // Merge the current thread's queued objects now rather than at its
+    // next release of an object it owns.
+    static void mergePending() {
+        if (RefCountMergeQueue *queue = currentQueue()) drainMergeQueue(queue);
+    }
+
+    // Called on the owning thread as it exits, once it has stopped
+    // handing out the queue.
+    static void queueExited(RefCountMergeQueue *queue) {
+        {
+            std::lock_guard<std::mutex> guard(queue->lock);
+            queue->ownerExited = true;
+        }
+        drainMergeQueue(queue);
+        RefCountMergeQueue::dropRefs(queue, RefCountMergeQueue::OWNER_BIAS - queue->ownerObjects);
+    }
+
+  private:
+    // The shared word holds the count in its upper bits and two flags.
+    static int64_t const MERGED = 1;  // the owner folded its count in
+    static int64_t const QUEUED = 2;  // waiting in the owner's queue
+    static int64_t const SHARED_ONE = 4;
+
+    static int64_t count(int64_t word) {
+        return word >> 2;
+    }
+
+    // `merged` and `biased` belong to the owner; other threads only read
+    // them after the owner has exited.
+    void mergeFromOwner() {
+        merged = true;
+        int64_t old = shared.fetch_or(MERGED, std::memory_order_acq_rel);
+        // A queued object is deleted when the queue gets to it.
+        if (!(old & QUEUED) && count(old) == 0) delete this;
+    }
+
+    // Fold the owner's count in, if it is not yet, and leave the queue.
+    void mergeQueued() {
+        int64_t delta = 0;
+        if (!merged) {
+            merged = true;
+            delta = (int64_t)biased * SHARED_ONE + MERGED;
+            biased = 0;
+        }
+        int64_t old = shared.load(std::memory_order_relaxed);
+        int64_t word;
+        do {
+            word = (old + delta) & ~QUEUED;
+        } while (!shared.compare_exchange_weak(old, word, std::memory_order_acq_rel, std::memory_order_relaxed));
+        if (count(word) == 0) delete this;
+    }
+
+    void releaseShared(uintptr_t n) {
+        int64_t old = shared.load(std::memory_order_relaxed);
+        int64_t word;
+        do {
+            word = old - (int64_t)n * SHARED_ONE;
+            // The owner still counts references that were just dropped.
+            if (!(word & MERGED) && count(word) < 0) word |= QUEUED;
+        } while (!shared.compare_exchange_weak(old, word, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+        if (word & MERGED) {
+            if (!(word & QUEUED) && count(word) == 0) delete this;
+        } else if ((word & QUEUED) && !(old & QUEUED)) {
+            enqueue();
+        }
+    }
+
+    void enqueue() {
+        RefCountMergeQueue *queue = ownerQueue;
+        {
+            std::lock_guard<std::mutex> guard(queue->lock);
+            if (!queue->ownerExited) {
+                queue->objects.push_back(this);
+                queue->pending.store(true, std::memory_order_relaxed);
+                return;
+            }
+        }
+        mergeQueued();
+    }
+
+    static void drainMergeQueue(RefCountMergeQueue *queue) {
+        std::vector<RefCounted *> objects;
+        {
+            std::lock_guard<std::mutex> guard(queue->lock);
+            objects.swap(queue->objects);
+            queue->pending.store(false, std::memory_order_relaxed);
+        }
+        for (RefCounted *object : objects) {
+            object->mergeQueued();
+        }
+    }
+
+    // The current thread's queue, kept in its pool thread state; nil if
+    // the thread hasn't created an object yet. localQueue() creates it.
+    static inline RefCountMergeQueue *currentQueue();
+    static inline RefCountMergeQueue *localQueue();
+
+    RefCountMergeQueue *const ownerQueue;
+    uintptr_t biased;
+    bool merged;
+    bool const immortal;
+    std::atomic<int64_t> shared{0};
+};
+
+struct Object : RefCounted {
+    std::string m_name;
+    Object(const std::string &name, bool immortal = false)
+        : RefCounted(immortal), m_name(name) {}
+    ~Object() {
+#if LOG_AUTORELEASEPOOL
+        std::cout << "<Object:" << this << "-" << m_name << "> dealloc" << std::endl;
+#endif
+    }
+
+    void release() {
+#if LOG_AUTORELEASEPOOL
+        std::cout << "<Object:" << this << "-" << m_name << "> call release" << std::endl;
+#endif
+        RefCounted::release();
+    }
+
+    void releaseN(uintptr_t n) {
+#if LOG_AUTORELEASEPOOL
+        std::cout << "<Object:" << this << "-" << m_name << "> call release x" << n << std::endl;
+#endif
+        RefCounted::releaseN(n);
+    }
+
+    std::string description() const {
+        std::stringstream ss;
+        ss << "<Object:" << this << "-" << m_name << ">";
+        return ss.str();
+    }
+};
+
+enum class AutoreleasePoolMemoryPressure {
+    Normal,
+    // Threads drop their spare pages at their next push, pop, or
+    // autorelease that moves to a new page.
+    Warning,
+    // Spare pages of idle threads are freed immediately.
+    Critical,
+};
+
+enum class AutoreleaseSampleMode {
+    Off,
+    // Capture the stack of every Nth autorelease.
+    Count,
+    // Capture the stack whenever another N bytes of pool pages are allocated.
+    Bytes,
+};
+
+// Call-site table for sampled autorelease stacks.
+// Only the owning thread records into a table, so recording needs no
+// locks or read-modify-writes. Readers on other threads may walk it at
+// any time: an entry's frames are written before its hash is published.
+struct AutoreleaseSampleTable {
+    static size_t const CAPACITY = 256;  // power of 2
+    static int const MAX_FRAMES = 32;
+
+    struct Entry {
+        std::atomic<uintptr_t> hash;  // 0 means empty
+        int depth;
+        void *frames[MAX_FRAMES];
+        std::atomic<uint64_t> weight;
+    };
+
+    Entry entries[CAPACITY];
+    std::atomic<uint64_t> dropped{0};  // weight of samples that found the table full
+
+    static uintptr_t hashFrames(void *const *frames, int depth) {
+        uintptr_t h = (uintptr_t)depth;
+        for (int i = 0; i < depth; i++) {
+            h = (h ^ (uintptr_t)frames[i]) * 0x100000001b3ULL;
+        }
+        return h | 1;
+    }
+
+    void record(void *const *frames, int depth, uint64_t weight) {
+        uintptr_t h = hashFrames(frames, depth);
+        for (size_t i = 0; i < CAPACITY; i++) {
+            Entry &e = entries[(h + i) & (CAPACITY - 1)];
+            uintptr_t eh = e.hash.load(std::memory_order_relaxed);
+            if (eh == 0) {
+                e.depth = depth;
+                memcpy(e.frames, frames, depth * sizeof(frames[0]));
+                e.weight.store(weight, std::memory_order_relaxed);
+                e.hash.store(h, std::memory_order_release);
+                return;
+            }
+            if (eh == h && e.depth == depth && 0 == memcmp(e.frames, frames, depth * sizeof(frames[0]))) {
+                e.weight.store(e.weight.load(std::memory_order_relaxed) + weight, std::memory_order_relaxed);
+                return;
+            }
+        }
+        dropped.store(dropped.load(std::memory_order_relaxed) + weight, std::memory_order_relaxed);
+    }
+
+    void mergeInto(AutoreleaseSampleTable *other) const {
+        for (size_t i = 0; i < CAPACITY; i++) {
+            const Entry &e = entries[i];
+            if (e.hash.load(std::memory_order_acquire) != 0) {
+                other->record(e.frames, e.depth, e.weight.load(std::memory_order_relaxed));
+            }
+        }
+        other->dropped.store(other->dropped.load(std::memory_order_relaxed) + dropped.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+    }
+
+    // One line per call site in the folded format flamegraph tools take:
+    // outermost frame first, frames separated by ';', then the weight.
+    void printFolded(FILE *out) const {
+        for (size_t i = 0; i < CAPACITY; i++) {
+            const Entry &e = entries[i];
+            if (e.hash.load(std::memory_order_acquire) == 0) continue;
+            for (int f = e.depth - 1; f >= 0; f--) {
+                Dl_info info;
+                if (dladdr(e.frames[f], &info) && info.dli_sname) {
+                    fprintf(out, "%s%s", info.dli_sname, f ? ";" : "");
+                } else {
+                    fprintf(out, "%p%s", e.frames[f], f ? ";" : "");
+                }
+            }
+            fprintf(out, " %llu\n", (unsigned long long)e.weight.load(std::memory_order_relaxed));
+        }
+        uint64_t lost = dropped.load(std::memory_order_relaxed);
+        if (lost) fprintf(out, "[dropped] %llu\n", (unsigned long long)lost);
+    }
+};
+
+#if TRACK_AUTORELEASEPOOL_SCOPES
+// Log-linear histogram. Values are grouped by power of two and each
+// power of two is split into SUB_BUCKETS linear steps, so a bucket is
+// never wider than 1/SUB_BUCKETS of the values it holds.
+// One thread records; other threads may read or merge it concurrently.
+struct AutoreleasePoolHistogram {
+    static int const SUB_BITS = 4;
+    static int const SUB_BUCKETS = 1 << SUB_BITS;
+    static int const BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    std::atomic<uint64_t> buckets[BUCKETS];
+
+    static int bucketFor(uint64_t value) {
+        if (value < SUB_BUCKETS) return (int)value;
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t lowestValueIn(int bucket) {
+        if (bucket < SUB_BUCKETS) return (uint64_t)bucket;
+        int shift = bucket / SUB_BUCKETS - 1;
+        return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+    // Owner thread only.
+    void record(uint64_t value) {
+        std::atomic<uint64_t> &bucket = buckets[bucketFor(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // The caller must be the only writer of this histogram.
+    void merge(const AutoreleasePoolHistogram &other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            uint64_t n = other.buckets[i].load(std::memory_order_relaxed);
+            if (n) buckets[i].store(buckets[i].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            total += buckets[i].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // Lowest value of the bucket holding the q-th quantile, 0 <= q <= 1.
+    uint64_t quantile(double q) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (double)(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return lowestValueIn(i);
+        }
+        return lowestValueIn(BUCKETS - 1);
+    }
+};
+
+// Histograms describing the pool scopes popped on one or more threads.
+struct AutoreleasePoolScopeStats {
+    AutoreleasePoolHistogram lifetimeNs;  // push() to pop()
+    AutoreleasePoolHistogram entries;     // page entries drained by pop()
+    AutoreleasePoolHistogram drainNs;     // time pop() spent releasing the objects
+
+    void merge(const AutoreleasePoolScopeStats &other) {
+        lifetimeNs.merge(other.lifetimeNs);
+        entries.merge(other.entries);
+        drainNs.merge(other.drainNs);
+    }
+};
+#endif
+
+// A C++ smart pointer whose ownership was moved into a pool. Its pool
+// entry is the record's address with bit 0 set, and bit 1 set for a
+// shared_ptr; tagged pointers, the only objects with bit 0 set, never
+// enter the pool. Free records are chained through `next`.
+struct alignas(16) AutoreleasePoolCxxRecord {
+    union {
+        struct {
+            void *ptr;
+            void (*destroy)(void *ptr);
+        } unique;
+        alignas(std::shared_ptr<void>) unsigned char shared[sizeof(std::shared_ptr<void>)];
+        AutoreleasePoolCxxRecord *next;
+    };
+
+    std::shared_ptr<void> *sharedPtr() {
+        return (std::shared_ptr<void> *)shared;
+    }
+};
+
+// Bump allocator behind AutoreleasePoolPage::scopedAlloc(). Memory is
+// only given back by rolling back to an earlier mark, which runs the
+// destructors registered since then, newest first. Chunks stay
+// allocated for re-use until trim().
+class ScopeArena {
+  public:
+    struct Destructor {
+        void (*destroy)(void *object);
+        void *object;
+    };
+
+  private:
+    static size_t const CHUNK_SIZE = 64 * 1024;
+
+    struct alignas(16) Chunk {
+        size_t size;  // bytes after the header
+
+        char *data() {
+            return (char *)(this + 1);
+        }
+    };
+
+    // chunks[current] is being filled; the ones above it are free.
+    std::vector<Chunk *> chunks;
+    size_t current = 0;
+    size_t used = 0;
+    std::vector<Destructor> destructors;
+
+    __attribute__((noinline)) void *allocSlow(size_t size, size_t align) {
+        size_t need = size + align;
+        size_t index = current < chunks.size() && used ? current + 1 : current;
+        if (index == chunks.size()) {
+            chunks.push_back(nil);
+        } else if (chunks[index]->size < need) {
+            free(chunks[index]);
+            chunks[index] = nil;
+        }
+        if (!chunks[index]) {
+            size_t bytes = need > CHUNK_SIZE ? need : CHUNK_SIZE;
+            chunks[index] = new (malloc(sizeof(Chunk) + bytes)) Chunk{bytes};
+        }
+        current = index;
+        used = 0;
+        return alloc(size, align);
+    }
+
+  public:
+    struct Mark {
+        size_t chunk;
+        size_t used;
+        size_t destructors;
+    };
+
+    ScopeArena() = default;
+    ScopeArena(const ScopeArena &) = delete;
+    ScopeArena &operator=(const ScopeArena &) = delete;
+
+    ~ScopeArena() {
+        ASSERT(destructors.empty());
+        for (Chunk *chunk : chunks) free(chunk);
+    }
+
+    Mark mark() const {
+        return {current, used, destructors.size()};
+    }
+
+    // align must be a power of two.
+    void *alloc(size_t size, size_t align) {
+        if (fastpath(current < chunks.size())) {
+            Chunk *chunk = chunks[current];
+            uintptr_t base = (uintptr_t)chunk->data();
+            size_t start = ((base + used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+            if (fastpath(start + size <= chunk->size)) {
+                used = start + size;
+                return chunk->data() + start;
+            }
+        }
+        return allocSlow(size, align);
+    }
+
+    void addDestructor(void (*destroy)(void *object), void *object) {
+        destructors.push_back({destroy, object});
+    }
+
+    // A destructor may use the arena only under a mark of its own that
+    // it rolls back before returning.
+    void rollback(Mark mark) {
+        while (destructors.size() > mark.destructors) {
+            Destructor d = destructors.back();
+            destructors.pop_back();
+            d.destroy(d.object);
+        }
+        current = mark.chunk;
+        used = mark.used;
+    }
+
+    // Take the destructors registered since `mark` without running them
+    // or giving back any memory.
+    std::vector<Destructor> detachDestructors(Mark mark) {
+        std::vector<Destructor> detached(destructors.begin() + (ptrdiff_t)mark.destructors, destructors.end());
+        destructors.resize(mark.destructors);
+        return detached;
+    }
+
+    // Run detached destructors, newest first.
+    static void runDestructors(std::vector<Destructor> &detached) {
+        while (!detached.empty()) {
+            Destructor d = detached.back();
+            detached.pop_back();
+            d.destroy(d.object);
+        }
+    }
+
+    // Free the chunks that hold nothing.
+    void trim() {
+        size_t keep = current + (used ? 1 : 0);
+        for (size_t i = keep; i < chunks.size(); i++) free(chunks[i]);
+        if (keep < chunks.size()) chunks.resize(keep);
+    }
+};
+
+// Pool bookkeeping for one thread that other threads may look at.
+// Every thread with pool pages has one, linked into a process-wide
+// registry so memory pressure can reach spare pages that are otherwise
+// only known to the owning thread.
+struct AutoreleasePoolThreadState {
+    AutoreleasePoolThreadState *prev;
+    AutoreleasePoolThreadState *next;
+
+    // Held while spare pages change hands between the owner and a reclaimer.
+    std::mutex lock;
+    // Hot page whose children are spare pages that a reclaimer may free.
+    // Only the owner sets it; whoever takes the spare pages clears it.
+    std::atomic<AutoreleasePoolPage *> spareRoot{nullptr};
+    // The owner should free its spare pages at its next push, pop or
+    // page change.
+    std::atomic<bool> trimRequested{false};
+
+    // Autoreleases or page bytes left until the next stack sample.
+    int64_t sampleCountdown;
+    // Allocated by the owner at its first sample.
+    std::atomic<AutoreleaseSampleTable *> samples{nullptr};
+
+    // Scopes popped with popIncremental() whose entries are still to be
+    // released, in the order they were popped. Whole pages of a scope
+    // are unlinked and walked from `top` down to `bottom` via `parent`;
+    // entries that shared a page with the enclosing scope are copied to
+    // pendingEntries[firstEntry, firstEntry + entries). Each scope is
+    // released newest entry first, as pop() would: its pages from the
+    // top down, then its copied entries from the last one back. Then the
+    // destructors of its scopedAlloc() memory run; the memory itself
+    // went to the enclosing scope. `position` is the slot position of
+    // the scope's boundary.
+    struct PendingEntry {
+        id obj;
+        uintptr_t releases;
+    };
+    struct PendingScope {
+        AutoreleasePoolPage *top;
+        AutoreleasePoolPage *bottom;
+        size_t firstEntry;
+        size_t entries;
+        size_t position;
+        std::vector<ScopeArena::Destructor> destructors;
+        // The scope ends the thread's epoch critical section.
+        bool leavesEpoch;
+    };
+    std::vector<PendingEntry> pendingEntries;
+    std::vector<PendingScope> pendingScopes;
+    // The oldest scope in pendingScopes that isn't drained yet.
+    size_t drainingScope = 0;
+    AutoreleasePoolDrainBudget drainBudget = {0, 0};
+    bool hasPending = false;
+    bool draining = false;
+
+    // Pages with a depth below this were set aside by reserve() and
+    // survive pops whatever the retention policy says.
+    uint32_t reservedDepth = 0;
+
+    // Pools pushed with push(expectedEntries), innermost last. Pages
+    // below `depth` survive pops until the pool whose boundary is at slot
+    // index `position` is popped; `depth` includes the enclosing pools'.
+    struct ReservedScope {
+        size_t position;
+        uint32_t depth;
+    };
+    std::vector<ReservedScope> reservedScopes;
+
+    // The thread's pages indexed by depth, spare pages included.
+    // Only the owner stores pages; a reclaimer lowers pageCount when it
+    // takes the spare pages.
+    AutoreleasePoolPage **pages = nullptr;
+    std::atomic<uint32_t> pageCount{0};
+    uint32_t pageCapacity = 0;
+
+    // Tokens of the open pools, innermost last, kept under
+    // DebugPoolOrder.
+    std::vector<void *> liveScopes;
+
+    // The thread's pages went past the thread budget and the overflow
+    // callback has run.
+    bool overPageBudget = false;
+
+    // Hash table kept between coalesced drains so that large pops don't
+    // reallocate it every time.
+    std::vector<PendingEntry> drainTable;
+
+    // Allocations made with scopedAlloc(), and where each scope that
+    // allocated starts in the arena, innermost last. `position` is the
+    // slot index of the hot page's next entry when the scope first
+    // allocated; popping a pool whose boundary lies below it rolls the
+    // arena back to `mark`.
+    struct ArenaScope {
+        size_t position;
+        ScopeArena::Mark mark;
+    };
+    ScopeArena arena;
+    std::vector<ArenaScope> arenaScopes;
+
+    // Records for autoreleased smart pointers, carved out of chunks of
+    // CXX_RECORD_CHUNK that live as long as the thread.
+    AutoreleasePoolCxxRecord *freeCxxRecords = nullptr;
+    std::vector<AutoreleasePoolCxxRecord *> cxxRecordChunks;
+
+    // Merge queue of the objects this thread creates; see RefCounted.
+    RefCountMergeQueue *refCountQueue = nullptr;
+
+    // Epoch-based reclamation. A registered thread's outermost pool is
+    // its critical section: `epoch` holds the global epoch it saw at
+    // the outermost push, and is zero while no pool is open.
+    // `epochScopePosition` is the slot position of that push; popping a
+    // pool at or below it leaves the critical section. If that pool was
+    // popped with popIncremental(), the section lasts until its entries
+    // are released: `epochPendingScopes` counts such pending scopes, and
+    // epochScopePosition is NO_EPOCH_SCOPE unless a new outermost pool
+    // has been pushed since, which then takes over the section.
+    struct RetiredNode {
+        void *node;
+        void (*free)(void *node);
+        uint64_t epoch;
+    };
+    std::atomic<uint64_t> epoch{0};
+    bool epochRegistered = false;
+    bool inEpoch = false;
+    size_t epochScopePosition = 0;
+    uint32_t epochPendingScopes = 0;
+    static size_t const NO_EPOCH_SCOPE = SIZE_MAX;
+    // Oldest first, so their epochs never decrease.
+    std::vector<RetiredNode> retired;
+    // Try to free retired nodes once there are this many.
+    size_t reclaimAt;
+
+#if TRACK_AUTORELEASEPOOL_SCOPES
+    static constexpr uint32_t MAX_TRACKED_SCOPES = 64;
+    struct Scope {
+        void *token;
+        uint64_t pushNs;
+    };
+    // Open scopes, innermost last. scopeDepth keeps counting past
+    // MAX_TRACKED_SCOPES; those scopes are not timed.
+    Scope scopes[MAX_TRACKED_SCOPES];
+    uint32_t scopeDepth;
+    AutoreleasePoolScopeStats *scopeStats;
+#endif
+};
+
+// Process-wide stack of free page-sized blocks.
+// Threads that exit hand their pages back here so that new threads can
+// install their first pages without going to malloc.
+// Pushes are lock-free. Pops take popLock, so only one thread at a time
+// reads the link of the top block: a block can only leave the stack
+// through the lock holder, which means the block it reads is still on
+// the stack and can't have been reused or freed, and the CAS can't be
+// fooled by a block that was popped and pushed back (ABA). A pop that
+// finds the lock taken returns nothing and the caller goes to malloc.
+template <size_t Align>
+class PageStack {
+    struct Node {
+        std::atomic<Node *> next;
+    };
+
+    std::atomic<Node *> head{nullptr};
+    std::atomic<size_t> count{0};
+    std::mutex popLock;
+
+  public:
+    // Returns false and leaves the block alone if the stack already
+    // holds `limit` blocks.
+    bool push(void *block, size_t limit) {
+        ASSERT(((uintptr_t)block & (Align - 1)) == 0);
+        if (count.fetch_add(1, std::memory_order_relaxed) >= limit) {
+            count.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        Node *node = (Node *)block;
+        Node *old = head.load(std::memory_order_relaxed);
+        do {
+            node->next.store(old, std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(old, node, std::memory_order_release, std::memory_order_relaxed));
+        return true;
+    }
+
+    void *pop() {
+        if (!head.load(std::memory_order_relaxed)) return nullptr;
+        std::unique_lock<std::mutex> lock(popLock, std::try_to_lock);
+        if (!lock.owns_lock()) return nullptr;
+
+        Node *node = head.load(std::memory_order_acquire);
+        do {
+            if (!node) return nullptr;
+        } while (!head.compare_exchange_weak(node, node->next.load(std::memory_order_relaxed),
+                                             std::memory_order_acquire, std::memory_order_acquire));
+        count.fetch_sub(1, std::memory_order_relaxed);
+        return node;
+    }
+
+    size_t size() const {
+        return count.load(std::memory_order_relaxed);
+    }
+};
+
+// Process-wide counter that each thread updates on a shard of its own,
+// so threads allocating pages don't contend on one cache line. Reading
+// it sums the shards; a shard may go negative when one thread frees
+// what another allocated.
+class ShardedCounter {
+    static size_t const SHARDS = 16;
+
+    struct alignas(64) Shard {
+        std::atomic<int64_t> value{0};
+    };
+    Shard shards[SHARDS];
+
+    static size_t shardIndex() {
+        uint64_t h = (uint64_t)(uintptr_t)pthread_self() * 0x9E3779B97F4A7C15ULL;
+        return (size_t)(h >> 32) % SHARDS;
+    }
+
+  public:
+    void add(int64_t n) {
+        shards[shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t sum() const {
+        int64_t total = 0;
+        for (const Shard &shard : shards) {
+            total += shard.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+// Release policy used when draining pool pages.
+// A coalesced entry stands for several autoreleases of the same object;
+// objects that implement releaseN() drop all of them with one call
+// (one fetch_sub and one zero check for an atomic refcount).
+// Everything else falls back to calling release() n times.
+template <typename T>
+struct ReleasePolicy {
+    // Immortal objects are handed back by autorelease() untouched.
+    static inline bool isImmortal(id obj) {
+        if constexpr (requires(T *t) { t->isImmortal(); }) {
+            return ((T *)obj)->isImmortal();
+        } else {
+            return false;
+        }
+    }
+
+    static inline void retain(id obj) {
+        ((T *)obj)->retain();
+    }
+
+    static inline void release(id obj) {
+        ((T *)obj)->release();
+    }
+
+    static inline void releaseN(id obj, uintptr_t n) {
+        if constexpr (requires(T *t) { t->releaseN(n); }) {
+            ((T *)obj)->releaseN(n);
+        } else {
+            for (uintptr_t i = 0; i < n; i++) {
+                ((T *)obj)->release();
+            }
+        }
+    }
+};
+
+class AutoreleasePoolPage : private AutoreleasePoolPageData {
+    friend struct thread_data_t;
+    friend class RefCounted;
+
+    typedef ReleasePolicy<Object> Releaser;
+
+  public:
+    // Environment options that change the pool's fast paths.
+    // autorelease, push and pop are instantiated for every combination
+    // and init() picks one set, so none of them test options at run time.
+    enum : unsigned {
+        OptCoalesce = 1 << 0,     // !DisableAutoreleaseCoalescing || !DisableAutoreleaseCoalescingLRU
+        OptCoalesceLRU = 1 << 1,  // !DisableAutoreleaseCoalescingLRU
+        OptDebugPoolAllocation = 1 << 2,
+        OptDebugMissingPools = 1 << 3,
+        OptPrintPoolHiwat = 1 << 4,
+        OptDebugPoolOrder = 1 << 5,
+
+        OptCombinations = 1 << 6,
+        OptDefaults = OptCoalesce | OptCoalesceLRU,
+    };
+
+    struct EntryPoints {
+        id (*autorelease)(id obj);
+        id (*autoreleaseN)(id obj, uintptr_t n);
+        void (*autoreleaseCxx)(id entry);
+        void *(*push)();
+        void (*pop)(void *token);
+    };
+
+    static size_t const SIZE =
+#if PROTECT_AUTORELEASEPOOL || GUARD_AUTORELEASEPOOL
+        PAGE_MAX_SIZE;  // must be multiple of vm page size
+#else
+        PAGE_MIN_SIZE;  // size and alignment, power of 2
+#endif
+
+    // Inaccessible bytes allocated after each page.
+    static size_t const GUARD_SIZE = GUARD_AUTORELEASEPOOL ? PAGE_MAX_SIZE : 0;
+
+    // Deep chains grow in larger chunks: the first CHUNK_RUN pages are
+    // SIZE bytes, the next CHUNK_RUN are CHUNK_RUN times that, and every
+    // page above is CHUNK_RUN times larger again. A page's size follows
+    // from its depth and every page is aligned to its own size.
+    static size_t const CHUNK_RUN = 16;
+    static unsigned const CHUNK_CLASSES = 3;
+    static constexpr size_t CHUNK_SIZES[CHUNK_CLASSES] = {SIZE, SIZE * CHUNK_RUN, SIZE * CHUNK_RUN * CHUNK_RUN};
+
+  private:
+    static pthread_key_t const key = AUTORELEASE_POOL_KEY;
+    static pthread_key_t const stateKey = AUTORELEASE_POOL_STATE_KEY;
+#if SUPPORT_RETURN_AUTORELEASE
+    static pthread_key_t const returnKey = RETURN_DISPOSITION_KEY;
+#endif
+    static uint8_t const SCRIBBLE = 0xA3;  // 0xA3A3A3A3 after releasing
+    static size_t const MAX_FAULTS = 2;
+
+    // Instantiation of autorelease, push and pop for the current options.
+    static EntryPoints entryPoints;
+
+    static AutoreleasePoolRetentionPolicy retention;
+
+    // Pops of at least this many entries release each object once,
+    // weighted by its number of entries. Zero disables it.
+    static size_t coalescedDrainThreshold;
+
+    // Pages of exited threads waiting to be picked up by new threads.
+    static size_t const MAX_CACHED_PAGES = 64;
+    static PageStack<SIZE> pageCache;
+
+    // All live AutoreleasePoolThreadStates.
+    static std::mutex registryLock;
+    static AutoreleasePoolThreadState *registry;
+
+    // Call-site sampling. Samples of exited threads are merged into
+    // exitedSamples so they survive until the next dump.
+    static AutoreleaseSampleMode sampleMode;
+    static uint64_t samplePeriod;
+    static AutoreleaseSampleTable *exitedSamples;
+
+#if TRACK_AUTORELEASEPOOL_SCOPES
+    static AutoreleasePoolScopeStats *exitedScopeStats;
+#endif
+
+    // Epoch-based reclamation. Epochs start at 1; a thread's epoch of 0
+    // means it is outside any critical section. Pool operations only
+    // look for critical sections while some thread is registered.
+    static size_t const RETIRE_BATCH = 64;
+    static std::atomic<uint64_t> globalEpoch;
+    static std::atomic<uint32_t> epochThreads;
+    // Retired nodes of exited threads, in epoch order, under registryLock.
+    static std::vector<AutoreleasePoolThreadState::RetiredNode> orphanedNodes;
+    static std::atomic<bool> hasOrphanedNodes;
+
+    // Number of threads with popIncremental() work outstanding. Pool
+    // operations only look for pending work while this is non-zero.
+    static std::atomic<uint32_t> threadsWithPendingDrain;
+
+    // Number of threads asked to trim by onMemoryPressure(). Pushes only
+    // look at their own request while this is non-zero.
+    static std::atomic<uint32_t> threadsWithTrimRequest;
+
+    // The options init() picked the entry points for.
+    static unsigned options;
+
+    // Pool memory limits, and pool memory of all threads in SIZE pages,
+    // page cache included.
+    static AutoreleasePoolPageBudget pageBudget;
+    static ShardedCounter pagesInUse;
+    static std::atomic<bool> overProcessBudget;
+
+    // EMPTY_POOL_PLACEHOLDER is stored in TLS when exactly one pool is
+    // pushed and it has never contained any objects. This saves memory
+    // when the top level (i.e. libdispatch) pushes and pops pools but
+    // never uses them.
+#define EMPTY_POOL_PLACEHOLDER ((id *)1)
+
+#define POOL_BOUNDARY nil
+
+    // chunkSize()-sizeof(*this) bytes of contents follow
+
+    static void *operator new(size_t size, void *p) {
+        return p;
+    }
+
+    // Page memory comes with its guard page, which stays inaccessible
+    // while the page sits in the page cache. Guarded pages are mapped on
+    // their own rather than protected inside a malloc block, where heap
+    // scanners such as LeakSanitizer would fault on the guard. A mapping
+    // is only VM-page aligned, so `size` extra bytes are mapped and the
+    // slack on either side of the aligned page is unmapped.
+    static void *allocChunk(size_t size) {
+#if GUARD_AUTORELEASEPOOL
+        size_t span = size + GUARD_SIZE;
+        void *mapped = mmap(nil, span + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (mapped == MAP_FAILED) return nil;
+        uintptr_t start = (uintptr_t)mapped;
+        uintptr_t aligned = (start + size - 1) & ~(uintptr_t)(size - 1);
+        if (aligned > start) munmap(mapped, aligned - start);
+        if (start + size > aligned) munmap((void *)(aligned + span), start + size - aligned);
+        void *p = (void *)aligned;
+        mprotect((uint8_t *)p + size, GUARD_SIZE, PROT_NONE);
+#if AUTORELEASEPOOL_LSAN_ROOTS
+        // Objects held only by a page must not be reported as leaks.
+        __lsan_register_root_region(p, size);
+#endif
+#else
+        void *p = malloc_zone_memalign(malloc_default_zone(), size, size);
+#endif
+        pagesInUse.add((int64_t)(size / SIZE));
+        return p;
+    }
+
+    static void freeChunk(void *p, size_t size) {
+        pagesInUse.add(-(int64_t)(size / SIZE));
+#if GUARD_AUTORELEASEPOOL
+#if AUTORELEASEPOOL_LSAN_ROOTS
+        __lsan_unregister_root_region(p, size);
+#endif
+        // Poisoning outlives the mapping; whatever is mapped here next
+        // must start out addressable.
+        ASAN_UNPOISON_MEMORY_REGION(p, size);
+        munmap(p, size + GUARD_SIZE);
+#else
+        free(p);
+#endif
+    }
+
+    static unsigned chunkClass(uint32_t depth) {
+        uint32_t cls = depth / CHUNK_RUN;
+        return cls < CHUNK_CLASSES - 1 ? cls : CHUNK_CLASSES - 1;
+    }
+
+    size_t chunkSize() const {
+        return CHUNK_SIZES[chunkClass(depth)];
+    }
+
+    // Install a new page, preferring a cached page from an exited thread.
+    // Only SIZE pages are cached.
+    static AutoreleasePoolPage *newPage(AutoreleasePoolPage *parent) {
+        size_t size = CHUNK_SIZES[chunkClass(parent ? parent->depth + 1 : 0)];
+        if (slowpath(sampleMode == AutoreleaseSampleMode::Bytes)) {
+            countForSampling(size);
+        }
+        void *p = size == SIZE ? pageCache.pop() : nil;
+        if (!p) p = allocChunk(size);
+        AutoreleasePoolPage *page = new (p) AutoreleasePoolPage(parent);
+
+        AutoreleasePoolThreadState *state = threadState();
+        ASSERT(state && state->pageCount.load(std::memory_order_relaxed) == page->depth);
+        if (page->depth == state->pageCapacity) {
+            state->pageCapacity = state->pageCapacity ? 2 * state->pageCapacity : 16;
+            state->pages = (AutoreleasePoolPage **)realloc(state->pages, state->pageCapacity * sizeof(*state->pages));
+        }
+        state->pages[page->depth] = page;
+        state->pageCount.store(page->depth + 1, std::memory_order_relaxed);
+
+        if (slowpath(pageBudget.threadPages || pageBudget.processPages)) {
+            checkPageBudget(state, page->depth + 1);
+        }
+        return page;
+    }
+
+    static __attribute__((noinline, cold)) void checkPageBudget(AutoreleasePoolThreadState *state, uint32_t count) {
+        if (size_t limit = pageBudget.threadPages) {
+            size_t pages = unitsBelow(count);
+            if (pages <= limit) {
+                state->overPageBudget = false;
+            } else if (!state->overPageBudget) {
+                state->overPageBudget = true;
+                if (pageBudget.overflow) pageBudget.overflow(AutoreleasePoolBudgetScope::Thread, pages, limit);
+            }
+        }
+        if (size_t limit = pageBudget.processPages) {
+            int64_t sum = pagesInUse.sum();
+            size_t pages = sum > 0 ? (size_t)sum : 0;
+            if (pages <= limit) {
+                overProcessBudget.store(false, std::memory_order_relaxed);
+            } else if (!overProcessBudget.exchange(true, std::memory_order_relaxed)) {
+                if (pageBudget.overflow) pageBudget.overflow(AutoreleasePoolBudgetScope::Process, pages, limit);
+            }
+        }
+    }
+
+    // The overflow callback for OBJC_DEBUG_POOL_DEPTH.
+    static void logPageBudgetOverflow(AutoreleasePoolBudgetScope scope, size_t pages, size_t limit) {
+        fprintf(stderr, "objc[%d]: %zu autorelease pool pages allocated %s, more than the limit of %zu\n",
+                getpid(), pages, scope == AutoreleasePoolBudgetScope::Thread ? "on this thread" : "in this process", limit);
+    }
+
+    inline void protect() {
+#if PROTECT_AUTORELEASEPOOL
+        mprotect(this, chunkSize(), PROT_READ);
+        check();
+#endif
+    }
+
+    inline void unprotect() {
+#if PROTECT_AUTORELEASEPOOL
+        check();
+        mprotect(this, chunkSize(), PROT_READ | PROT_WRITE);
+#endif
+    }
+
+    AutoreleasePoolPage(AutoreleasePoolPage *newParent)
+        : AutoreleasePoolPageData(begin(),
+                                  limitFor(newParent ? 1 + newParent->depth : 0),
+                                  pthread_self(),
+                                  newParent,
+                                  newParent ? 1 + newParent->depth : 0,
+                                  newParent ? newParent->hiwat : 0) {
+
+        if (parent) {
+            ASSERT(!parent->child);
+            parent->unprotect();
+            parent->child = this;
+            parent->protect();
+        }
+        poison(begin(), end());
+        protect();
+    }
+
+    ~AutoreleasePoolPage() {
+        check();
+        unprotect();
+        ASSERT(empty());
+
+        // Not recursive: we don't want to blow out the stack
+        // if a thread accumulates a stupendous amount of garbage
+        ASSERT(!child);
+    }
+
+    template <typename Fn>
+    void
+    busted(Fn log) const {
+        magic_t right;
+        log("autorelease pool page %p corrupted\n"
+            "  magic     0x%08x 0x%08x 0x%08x 0x%08x\n"
+            "  should be 0x%08x 0x%08x 0x%08x 0x%08x\n"
+            "  pthread   %p\n"
+            "  should be %p\n",
+            this,
+            magic.m[0], magic.m[1], magic.m[2], magic.m[3],
+            right.m[0], right.m[1], right.m[2], right.m[3],
+            this->thread, objc_thread_self());
+    }
+
+    __attribute__((noinline, cold, noreturn)) void
+    busted_die() const {
+        //        busted(_objc_fatal);
+        __builtin_unreachable();
+    }
+
+    inline void
+    check(bool die = true) const {
+        if (!magic.check() || thread != objc_thread_self()) {
+            if (die) {
+                busted_die();
+            } else {
+                //                busted(_objc_inform);
+            }
+        }
+    }
+
+    inline void
+    fastcheck() const {
+#if CHECK_AUTORELEASEPOOL
+        check();
+#else
+        if (!magic.fastcheck()) {
+            busted_die();
+        }
+#endif
+    }
+
+    id *begin() {
+        return (id *)((uint8_t *)this + sizeof(*this));
+    }
+
+    // Under GUARD_AUTORELEASEPOOL and AddressSanitizer, slots (and their
+    // counts) are poisoned whenever they don't hold an entry.
+    void poison(id *from, id *to) {
+#if GUARD_AUTORELEASEPOOL
+        ASAN_POISON_MEMORY_REGION(from, (to - from) * sizeof(id));
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS && AUTORELEASEPOOL_SPLIT_LAYOUT
+        ASAN_POISON_MEMORY_REGION(counts() + (from - begin()), (to - from) * sizeof(EntryCount));
+#endif
+#endif
+    }
+
+    void unpoison(id *from, id *to) {
+#if GUARD_AUTORELEASEPOOL
+        ASAN_UNPOISON_MEMORY_REGION(from, (to - from) * sizeof(id));
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS && AUTORELEASEPOOL_SPLIT_LAYOUT
+        ASAN_UNPOISON_MEMORY_REGION(counts() + (from - begin()), (to - from) * sizeof(EntryCount));
+#endif
+#endif
+    }
+
+    id *limitFor(uint32_t depth) {
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS && AUTORELEASEPOOL_SPLIT_LAYOUT
+        return begin() + CHUNK_ENTRIES[chunkClass(depth)];
+#else
+        return (id *)((uint8_t *)this + CHUNK_SIZES[chunkClass(depth)]);
+#endif
+    }
+
+    id *end() {
+        return limit;
+    }
+
+    bool empty() {
+        return next == begin();
+    }
+
+    bool full() {
+        return next == end();
+    }
+
+    bool lessThanHalfFull() {
+        return (next - begin() < (end() - begin()) / 2);
+    }
+
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+    // Each entry is an object and a count of the additional
+    // autoreleases beyond the first one.
+#if AUTORELEASEPOOL_SPLIT_LAYOUT
+    // The counts live in an array of their own that ends at the end of the
+    // page, one byte per slot of the pointer array. A saturated count is
+    // not extended; the next autorelease starts a new entry.
+    typedef uint8_t EntryCount;
+    static uintptr_t const MAX_ENTRY_COUNT = UINT8_MAX;
+#define ENTRIES_FOR(size) (((size) - sizeof(AutoreleasePoolPageData)) / (sizeof(id) + sizeof(EntryCount)))
+    static constexpr size_t CHUNK_ENTRIES[CHUNK_CLASSES] = {ENTRIES_FOR(CHUNK_SIZES[0]), ENTRIES_FOR(CHUNK_SIZES[1]), ENTRIES_FOR(CHUNK_SIZES[2])};
+#undef ENTRIES_FOR
+
+    // The counts start right after the last pointer slot.
+    EntryCount *counts() {
+        return (EntryCount *)end();
+    }
+
+    static id entryObject(id *slot) {
+        return *slot;
+    }
+
+    uintptr_t entryCount(id *slot) {
+        return counts()[slot - begin()];
+    }
+
+    void setEntryCount(id *slot, uintptr_t count) {
+        counts()[slot - begin()] = (EntryCount)count;
+    }
+
+    // Move the entry at slot to top, shifting the entries in between down.
+    void moveEntryToTop(id *slot, id *top) {
+        id obj = *slot;
+        EntryCount count = counts()[slot - begin()];
+        memmove(slot, slot + 1, (top - slot) * sizeof(*slot));
+        memmove(&counts()[slot - begin()], &counts()[slot - begin() + 1], (top - slot) * sizeof(count));
+        *top = obj;
+        counts()[top - begin()] = count;
+    }
+#else
+    static uintptr_t const MAX_ENTRY_COUNT = AutoreleasePoolEntry::maxCount;
+
+    static id entryObject(id *slot) {
+        // create an obj with the zeroed out top byte
+        return (id)((AutoreleasePoolEntry *)slot)->ptr;
+    }
+
+    uintptr_t entryCount(id *slot) {
+        return ((AutoreleasePoolEntry *)slot)->count;
+    }
+
+    void setEntryCount(id *slot, uintptr_t count) {
+        ((AutoreleasePoolEntry *)slot)->count = count;
+    }
+
+    void moveEntryToTop(id *slot, id *top) {
+        AutoreleasePoolEntry found = *(AutoreleasePoolEntry *)slot;
+        memmove(slot, slot + 1, (top - slot) * sizeof(*slot));
+        *(AutoreleasePoolEntry *)top = found;
+    }
+#endif
+#endif
+
+    static constexpr size_t entriesPerChunk(unsigned cls) {
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS && AUTORELEASEPOOL_SPLIT_LAYOUT
+        return CHUNK_ENTRIES[cls];
+#else
+        return (CHUNK_SIZES[cls] - sizeof(AutoreleasePoolPageData)) / sizeof(id);
+#endif
+    }
+
+#if LOG_AUTORELEASEPOOL
+    static std::string describeEntry(id obj) {
+        if (isCxxEntry(obj)) {
+            std::stringstream ss;
+            ss << ((uintptr_t)obj & CXX_SHARED ? "<shared_ptr:" : "<unique_ptr:") << (void *)cxxRecord(obj) << ">";
+            return ss.str();
+        }
+        return ((Object *)obj)->description();
+    }
+#endif
+
+    template <unsigned Opts>
+    id *add(id obj) {
+        ASSERT(!full());
+        unprotect();
+        id *ret;
+#if LOG_AUTORELEASEPOOL
+        std::stringstream ss;
+#endif
+
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+        if constexpr (Opts & OptCoalesce) {
+            if constexpr (Opts & OptCoalesceLRU) {
+                if (!empty() && (obj != POOL_BOUNDARY)) {
+                    id *topSlot = next - 1;
+                    for (uintptr_t offset = 0; offset < 4; offset++) {
+                        id *offsetSlot = topSlot - offset;
+                        if (offsetSlot <= begin() || *offsetSlot == POOL_BOUNDARY) {
+                            break;
+                        }
+                        if (entryObject(offsetSlot) == obj && entryCount(offsetSlot) < MAX_ENTRY_COUNT) {
+                            if (offset > 0) {
+                                moveEntryToTop(offsetSlot, topSlot);
+                            }
+                            setEntryCount(topSlot, entryCount(topSlot) + 1);
+                            ret = topSlot;  // need to reset ret
+#if LOG_AUTORELEASEPOOL
+                            std::cout << "use optimize LRU " << describeEntry(obj) << " count " << (entryCount(topSlot) + 1) << std::endl;
+#endif
+                            goto done;
+                        }
+                    }
+                }
+            } else {
+                if (!empty() && (obj != POOL_BOUNDARY)) {
+                    id *prevSlot = next - 1;
+                    if (entryObject(prevSlot) == obj && entryCount(prevSlot) < MAX_ENTRY_COUNT) {
+                        setEntryCount(prevSlot, entryCount(prevSlot) + 1);
+                        ret = prevSlot;  // need to reset ret
+#if LOG_AUTORELEASEPOOL
+                        std::cout << "use optimize " << describeEntry(obj) << " count " << (entryCount(prevSlot) + 1) << std::endl;
+#endif
+                        goto done;
+                    }
+                }
+            }
+        }
+#endif
+        ret = next;  // faster than `return next-1` because of aliasing
+#if LOG_AUTORELEASEPOOL
+        if (ret == begin()) {
+            ss << "befer next " << ret << " empty";
+        } else if (*(ret - 1) == POOL_BOUNDARY) {
+            ss << "befer next <POOL_BOUNDARY:" << ret << ">";
+        } else {
+            ss << "befer next " << describeEntry(*(ret - 1));
+        }
+
+        if (obj == POOL_BOUNDARY) {
+            ss << " add obj <POOL_BOUNDARY:" << obj << ">";
+        } else {
+            ss << " add obj " << describeEntry(obj);
+        }
+#endif
+
+        unpoison(next, next + 1);
+        *next++ = obj;
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS && AUTORELEASEPOOL_SPLIT_LAYOUT
+        setEntryCount(ret, 0);
+#endif
+
+#if LOG_AUTORELEASEPOOL
+        std::cout << ss.str() << " after next " << next << std::endl;
+#endif
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+        // Make sure obj fits in the bits available for it
+        ASSERT(entryObject(ret) == obj);
+#endif
+    done:
+        __attribute__((unused));
+        protect();
+        return ret;
+    }
+
+    // Add n autoreleases of obj, writing the repeat count directly
+    // instead of going through add() n times.
+    // Returns the entry written last; n is decremented by the number of
+    // autoreleases recorded, which is less than requested if the page fills.
+    template <unsigned Opts>
+    id *addN(id obj, uintptr_t &n) {
+        ASSERT(!full());
+        ASSERT(obj != POOL_BOUNDARY);
+        ASSERT(n > 0);
+        unprotect();
+        id *ret = nil;
+
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+        if constexpr (Opts & OptCoalesce) {
+            if (!empty() && *(next - 1) != POOL_BOUNDARY) {
+                id *topSlot = next - 1;
+                if (entryObject(topSlot) == obj) {
+                    uintptr_t room = MAX_ENTRY_COUNT - entryCount(topSlot);
+                    uintptr_t taken = n < room ? n : room;
+                    setEntryCount(topSlot, entryCount(topSlot) + taken);
+                    n -= taken;
+                    ret = topSlot;
+                }
+            }
+            while (n > 0 && !full()) {
+                // count is the number of autoreleases beyond the first one
+                uintptr_t taken = n < MAX_ENTRY_COUNT + 1 ? n : MAX_ENTRY_COUNT + 1;
+                unpoison(next, next + 1);
+                ret = next++;
+                *ret = obj;
+                setEntryCount(ret, taken - 1);
+                n -= taken;
+                // Make sure obj fits in the bits available for it
+                ASSERT(entryObject(ret) == obj);
+            }
+#if LOG_AUTORELEASEPOOL
+            std::cout << "add obj " << describeEntry(obj) << " remaining " << n << " after next " << next << std::endl;
+#endif
+            protect();
+            return ret;
+        }
+#endif
+        while (n > 0 && !full()) {
+            ret = next;
+            unpoison(next, next + 1);
+            *next++ = obj;
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS && AUTORELEASEPOOL_SPLIT_LAYOUT
+            setEntryCount(ret, 0);
+#endif
+            n--;
+        }
+#if LOG_AUTORELEASEPOOL
+        std::cout << "add obj " << describeEntry(obj) << " remaining " << n << " after next " << next << std::endl;
+#endif
+        protect();
+        return ret;
+    }
+
+    // Fault in the unused part of this page so that adding to it later
+    // doesn't take a page fault. Each byte is written back unchanged, so
+    // entries and counts that are in use survive.
+    void prefault() {
+        unprotect();
+        unpoison(next, end());
+        for (char *p = (char *)next; p < (char *)this + chunkSize(); p += PAGE_MIN_SIZE) {
+            volatile char *byte = p;
+            *byte = *byte;
+        }
+        poison(next, end());
+        protect();
+    }
+
+    void releaseAll() {
+        releaseUntil(begin());
+    }
+
+    static inline void releaseEntry(id obj, uintptr_t releases) {
+        if (slowpath(isCxxEntry(obj))) {
+            ASSERT(releases == 1);
+            releaseCxxEntry(obj);
+        } else if (releases == 1) {
+            //                    objc_release(obj);
+            Releaser::release(obj);
+        } else {
+            Releaser::releaseN(obj, releases);
+        }
+    }
+
+    void releaseUntil(id *stop) {
+        // Not recursive: we don't want to blow out the stack
+        // if a thread accumulates a stupendous amount of garbage
+
+        while (this->next != stop) {
+            // Restart from hotPage() every time, in case -release
+            // autoreleased more objects
+            AutoreleasePoolPage *page = hotPage();
+
+            // fixme I think this `while` can be `if`, but I can't prove it
+            while (page->empty()) {
+                if (slowpath(retention.kind == AutoreleasePoolRetentionPolicy::DropIdle)) {
+                    page->unprotect();
+                    page->idleSince = nowMs();
+                    page->protect();
+                }
+                page = page->parent;
+                setHotPage(page);
+            }
+
+            page->unprotect();
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+            id *slot = --page->next;
+
+            id obj = entryObject(slot);
+            int count = (int)page->entryCount(slot);  // grab these before memset
+#else
+            id obj = *--page->next;
+#endif
+            memset((void *)page->next, SCRIBBLE, sizeof(*page->next));
+            page->poison(page->next, page->next + 1);
+            page->protect();
+
+            if (obj != POOL_BOUNDARY) {
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+                // release count+1 times since it is count of the additional
+                // autoreleases beyond the first one
+                releaseEntry(obj, (uintptr_t)count + 1);
+#else
+                releaseEntry(obj, 1);
+#endif
+            }
+        }
+
+        setHotPage(this);
+
+#if DEBUG
+        // we expect any children to be completely empty
+        AutoreleasePoolThreadState *state = threadState();
+        for (uint32_t d = depth + 1; d < state->pageCount.load(std::memory_order_relaxed); d++) {
+            ASSERT(state->pages[d]->empty());
+        }
+#endif
+    }
+
+    // Empty everything above stop, then release every distinct object
+    // once with the total of its entries' counts. Objects are released
+    // in no particular order. Anything autoreleased by those releases
+    // is left above stop for releaseUntil().
+    void releaseUntilCoalesced(id *stop) {
+        AutoreleasePoolThreadState *state = threadState();
+        ASSERT(state);
+
+        // Taken rather than borrowed: a release may pop a large scope
+        // of its own.
+        std::vector<AutoreleasePoolThreadState::PendingEntry> table = std::move(state->drainTable);
+        // Linear probing, kept at most half full. Sized for the
+        // distinct objects seen so far rather than for the entries,
+        // so a scope made of a few objects stays in cache.
+        unsigned bits = 6;
+        size_t used = 0;
+        table.assign((size_t)1 << bits, {nil, 0});
+
+        AutoreleasePoolPage *page = hotPage();
+        while (true) {
+            id *bottom = page == this ? stop : page->begin();
+            id *top = page->next;
+            page->unprotect();
+            for (id *slot = bottom; slot < top; slot++) {
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+                id obj = entryObject(slot);
+                uintptr_t releases = page->entryCount(slot) + 1;
+#else
+                id obj = *slot;
+                uintptr_t releases = 1;
+#endif
+                if (obj == POOL_BOUNDARY) continue;
+                if (slowpath(used * 2 >= table.size())) growDrainTable(table, ++bits);
+                size_t i = drainTableIndex(obj, bits);
+                while (table[i].obj && table[i].obj != obj) i = (i + 1) & (table.size() - 1);
+                if (!table[i].obj) {
+                    table[i].obj = obj;
+                    used++;
+                }
+                table[i].releases += releases;
+            }
+            if (top > bottom) {
+                memset((void *)bottom, SCRIBBLE, (size_t)(top - bottom) * sizeof(*bottom));
+                page->poison(bottom, top);
+                page->next = bottom;
+            }
+            if (page != this && slowpath(retention.kind == AutoreleasePoolRetentionPolicy::DropIdle)) {
+                page->idleSince = nowMs();
+            }
+            page->protect();
+            if (page == this) break;
+            page = page->parent;
+        }
+        setHotPage(this);
+
+        for (const auto &entry : table) {
+            if (entry.obj) releaseEntry(entry.obj, entry.releases);
+        }
+
+        if (table.capacity() > state->drainTable.capacity()) {
+            state->drainTable = std::move(table);
+        }
+    }
+
+    static inline size_t drainTableIndex(id obj, unsigned bits) {
+        return (size_t)(((uint64_t)(uintptr_t)obj >> 4) * 0x9E3779B97F4A7C15ull >> (64 - bits));
+    }
+
+    static __attribute__((noinline)) void
+    growDrainTable(std::vector<AutoreleasePoolThreadState::PendingEntry> &table, unsigned bits) {
+        std::vector<AutoreleasePoolThreadState::PendingEntry> old = std::move(table);
+        table.assign((size_t)1 << bits, {nil, 0});
+        for (const auto &entry : old) {
+            if (!entry.obj) continue;
+            size_t i = drainTableIndex(entry.obj, bits);
+            while (table[i].obj) i = (i + 1) & (table.size() - 1);
+            table[i] = entry;
+        }
+    }
+
+    // Move everything above stop onto the thread's pending-drain list
+    // without releasing it, and make this page the hot page. Entries on
+    // this page are copied out; the pages above it are unlinked whole,
+    // spare pages included. `destructors` run once they are released.
+    void unlinkScope(id *stop, AutoreleasePoolThreadState *state, std::vector<ScopeArena::Destructor> &&destructors) {
+        size_t position = positionOf(this, stop);
+        claimSparePages();
+
+        size_t firstEntry = state->pendingEntries.size();
+        unprotect();
+        for (id *slot = stop; slot < next; slot++) {
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+            id obj = entryObject(slot);
+            uintptr_t releases = entryCount(slot) + 1;
+#else
+            id obj = *slot;
+            uintptr_t releases = 1;
+#endif
+            if (obj != POOL_BOUNDARY) {
+                state->pendingEntries.push_back({obj, releases});
+            }
+        }
+        memset((void *)stop, SCRIBBLE, (next - stop) * sizeof(*stop));
+        poison(stop, next);
+        next = stop;
+
+        AutoreleasePoolPage *unlinked = child;
+        child = nil;
+        protect();
+        state->pageCount.store(depth + 1, std::memory_order_relaxed);
+
+        size_t entries = state->pendingEntries.size() - firstEntry;
+        if (unlinked || entries || !destructors.empty()) {
+            AutoreleasePoolPage *top = unlinked;
+            while (top && top->child) top = top->child;
+            state->pendingScopes.push_back({top, unlinked, firstEntry, entries, position, std::move(destructors), false});
+        }
+
+        setHotPage(this);
+
+        if (!state->hasPending && !state->pendingScopes.empty()) {
+            state->hasPending = true;
+            threadsWithPendingDrain.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // With `recycle` set, freed pages go to the process-wide page cache
+    // (as long as it has room) instead of back to malloc.
+    void kill(bool recycle = false) {
+        AutoreleasePoolThreadState *state = threadState();
+        ASSERT(state && state->pages[depth] == this);
+
+        if (parent) {
+            parent->unprotect();
+            parent->child = nil;
+            parent->protect();
+        }
+
+        // Top down, so that every page is the last in the chain
+        // when it dies.
+        // This page dies too, so don't read its depth in the loop.
+        uint32_t bottom = depth;
+        uint32_t count = state->pageCount.load(std::memory_order_relaxed);
+        state->pageCount.store(bottom, std::memory_order_relaxed);
+        for (uint32_t d = count; d-- > bottom;) {
+            AutoreleasePoolPage *deathptr = state->pages[d];
+            deathptr->unprotect();
+            deathptr->child = nil;
+            size_t size = deathptr->chunkSize();
+            deathptr->~AutoreleasePoolPage();
+            if (!recycle || size != SIZE || !pageCache.push(deathptr, MAX_CACHED_PAGES)) {
+                freeChunk(deathptr, size);
+            }
+        }
+    }
+
+    static uint64_t nowMs() {
+        using namespace std::chrono;
+        return (uint64_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    static uint64_t nowNs() {
+        using namespace std::chrono;
+        return (uint64_t)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+#if TRACK_AUTORELEASEPOOL_SCOPES
+    static void recordScopeStart(void *token) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        if (state->scopeDepth < AutoreleasePoolThreadState::MAX_TRACKED_SCOPES) {
+            state->scopes[state->scopeDepth] = {token, nowNs()};
+        }
+        state->scopeDepth++;
+    }
+
+    // Popping a scope also pops every scope pushed after it.
+    static void recordScopeEnd(void *token, size_t entries, uint64_t drainNs) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state || state->scopeDepth == 0) return;
+
+        uint32_t depth = state->scopeDepth < AutoreleasePoolThreadState::MAX_TRACKED_SCOPES
+                             ? state->scopeDepth
+                             : AutoreleasePoolThreadState::MAX_TRACKED_SCOPES;
+        while (depth > 0 && state->scopes[depth - 1].token != token) {
+            depth--;
+        }
+        if (depth == 0) {
+            // An untimed scope above the tracked ones. It may take other
+            // untimed scopes with it; the count is corrected when a
+            // tracked scope is popped.
+            if (state->scopeDepth > AutoreleasePoolThreadState::MAX_TRACKED_SCOPES) state->scopeDepth--;
+            return;
+        }
+
+        uint64_t lifetime = nowNs() - state->scopes[depth - 1].pushNs;
+        state->scopeDepth = depth - 1;
+
+        state->scopeStats->lifetimeNs.record(lifetime);
+        state->scopeStats->entries.record(entries);
+        state->scopeStats->drainNs.record(drainNs);
+    }
+#endif
+
+    // Number of entries between stop and the top of the hot page.
+    // Pages in between are assumed full, which they are unless
+    // DebugPoolAllocation started pools on fresh pages.
+    static size_t entriesAbove(AutoreleasePoolPage *page, id *stop) {
+        AutoreleasePoolPage *hot = hotPage();
+        return positionOf(hot, hot->next) - positionOf(page, stop);
+    }
+
+    // Index of slot counting from the bottom of the thread's cold page.
+    // Grows with every slot up the chain, whether or not pages are full.
+    static size_t positionOf(AutoreleasePoolPage *page, id *slot) {
+        return capacityBelow(page->depth) + (slot - page->begin());
+    }
+
+    // Number of pages of size class cls below depth.
+    static uint32_t classPagesBelow(uint32_t depth, unsigned cls) {
+        uint32_t start = cls * CHUNK_RUN;
+        if (depth <= start) return 0;
+        uint32_t pages = depth - start;
+        return cls < CHUNK_CLASSES - 1 && pages > CHUNK_RUN ? CHUNK_RUN : pages;
+    }
+
+    // Total slots of the pages below depth.
+    static size_t capacityBelow(uint32_t depth) {
+        size_t capacity = 0;
+        for (unsigned cls = 0; cls < CHUNK_CLASSES; cls++) {
+            capacity += classPagesBelow(depth, cls) * entriesPerChunk(cls);
+        }
+        return capacity;
+    }
+
+    // Memory of the pages below depth, in pages of SIZE.
+    static size_t unitsBelow(uint32_t depth) {
+        size_t units = 0;
+        for (unsigned cls = 0; cls < CHUNK_CLASSES; cls++) {
+            units += classPagesBelow(depth, cls) * (CHUNK_SIZES[cls] / SIZE);
+        }
+        return units;
+    }
+
+    // Returns the depth of the first empty child of this page that the
+    // retention policy does not want to keep, or the thread's page count
+    // if every child survives. Spare pages are only ever killed from the
+    // top of the chain down to the returned depth, so policies answer
+    // with a cut point.
+    uint32_t firstUnretainedDepth(AutoreleasePoolThreadState *state) {
+        uint32_t count = state->pageCount.load(std::memory_order_relaxed);
+        uint32_t d = depth + 1;
+        switch (retention.kind) {
+        case AutoreleasePoolRetentionPolicy::Hysteresis:
+            // hysteresis: keep one empty child if page is more than half full
+            if (lessThanHalfFull()) return d;
+            return d < count ? d + 1 : d;
+
+        case AutoreleasePoolRetentionPolicy::KeepPages:
+            return count - d < retention.limit ? count : d + (uint32_t)retention.limit;
+
+        case AutoreleasePoolRetentionPolicy::KeepBytes:
+            for (uint64_t kept = 0; d < count && (kept += state->pages[d]->chunkSize()) <= retention.limit;) {
+                d++;
+            }
+            return d;
+
+        case AutoreleasePoolRetentionPolicy::DropIdle: {
+            // Pages higher in the chain stopped being hot no later than
+            // the pages below them, so the first expired page is the cut.
+            uint64_t now = nowMs();
+            while (d < count && now - state->pages[d]->idleSince < retention.limit) {
+                d++;
+            }
+            return d;
+        }
+        }
+        return d;
+    }
+
+    void killUnretainedChildren() {
+        AutoreleasePoolThreadState *state = threadState();
+        uint32_t d = firstUnretainedDepth(state);
+        if (d < state->reservedDepth) d = state->reservedDepth;
+        if (!state->reservedScopes.empty() && d < state->reservedScopes.back().depth) {
+            d = state->reservedScopes.back().depth;
+        }
+        if (d < state->pageCount.load(std::memory_order_relaxed)) state->pages[d]->kill();
+    }
+
+    static void tls_dealloc(void *p) {
+        if (p == (void *)EMPTY_POOL_PLACEHOLDER) {
+            // No objects or pool pages to clean up here.
+            return;
+        }
+
+        // reinstate TLS value while we work
+        setHotPage((AutoreleasePoolPage *)p);
+
+        AutoreleasePoolThreadState *state = threadState();
+        if (state && state->hasPending) drainPendingEntries(state, {0, 0});
+
+        if (state) state->liveScopes.clear();
+        claimSparePages();
+        if (AutoreleasePoolPage *page = coldPage()) {
+            // Release everything directly rather than through pop(),
+            // which would free spare pages that we want to hand over.
+            // Arena destructors may autorelease, and releases may
+            // allocate from the arena, so repeat until both are empty.
+            do {
+                if (!page->empty()) page->releaseAll();  // pop all of the pools
+                if (state) releaseScopedAllocations(state, 0);
+            } while (!page->empty() || (state && !state->arenaScopes.empty()));
+            page->kill(true);  // hand all of the pages to the next thread
+        }
+
+        // clear TLS value so TLS destruction doesn't loop
+        setHotPage(nil);
+    }
+
+    // Roll the arena back past every scope that first allocated at or
+    // above position `from`.
+    static void releaseScopedAllocations(AutoreleasePoolThreadState *state, size_t from) {
+        std::vector<AutoreleasePoolThreadState::ArenaScope> &scopes = state->arenaScopes;
+        size_t i = scopes.size();
+        while (i > 0 && scopes[i - 1].position >= from) i--;
+        if (i == scopes.size()) return;
+
+        ScopeArena::Mark mark = scopes[i].mark;
+        scopes.resize(i);
+        state->arena.rollback(mark);
+    }
+
+    // For popIncremental(): take the destructors of every scope that
+    // first allocated above the boundary at `position`, and leave their
+    // memory to the enclosing scope, whose next slot is `position`. The
+    // memory can't be reused before the destructors have run: the
+    // enclosing scope's pop finishes pending scopes first.
+    static std::vector<ScopeArena::Destructor> detachScopedAllocations(AutoreleasePoolThreadState *state, size_t position) {
+        std::vector<AutoreleasePoolThreadState::ArenaScope> &scopes = state->arenaScopes;
+        size_t i = scopes.size();
+        while (i > 0 && scopes[i - 1].position > position) i--;
+        if (i == scopes.size()) return {};
+
+        ScopeArena::Mark mark = scopes[i].mark;
+        scopes.resize(i);
+        if (scopes.empty() || scopes.back().position != position) {
+            scopes.push_back({position, mark});
+        }
+        return state->arena.detachDestructors(mark);
+    }
+
+    // Pending scopes nested in a scope being popped at `position` go
+    // first, as they would have with pop(). Everything pending was
+    // popped before them, so it all goes.
+    static __attribute__((noinline)) void drainPendingWithin(AutoreleasePoolThreadState *state, size_t position) {
+        for (size_t i = state->drainingScope; i < state->pendingScopes.size(); i++) {
+            if (state->pendingScopes[i].position > position) {
+                drainPendingEntries(state, {0, 0});
+                return;
+            }
+        }
+    }
+
+    static __attribute__((noinline)) void enterEpoch(void *token) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state || !state->epochRegistered) return;
+        AutoreleasePoolPage *hot = hotPage();
+        size_t position = token == (void *)EMPTY_POOL_PLACEHOLDER ? 0 : positionOf(hot, (id *)token);
+        if (state->inEpoch) {
+            // A pending scope still holds the section; this pool joins it.
+            if (state->epochScopePosition == AutoreleasePoolThreadState::NO_EPOCH_SCOPE) {
+                state->epochScopePosition = position;
+            }
+            return;
+        }
+        state->inEpoch = true;
+        state->epochScopePosition = position;
+        state->epoch.store(globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        // Publish the epoch before reading anything it protects.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    static inline void leaveEpochIfNeeded(size_t position) {
+        if (slowpath(epochThreads.load(std::memory_order_relaxed) != 0)) {
+            AutoreleasePoolThreadState *state = threadState();
+            if (state && state->inEpoch) leaveEpoch(state, position);
+        }
+    }
+
+    // Called after the pool's objects have been released, so their
+    // deallocation is still inside the critical section.
+    static __attribute__((noinline)) void leaveEpoch(AutoreleasePoolThreadState *state, size_t position) {
+        if (position > state->epochScopePosition) return;
+        if (state->epochPendingScopes) {
+            // Objects of scopes popped incrementally are still to go.
+            state->epochScopePosition = AutoreleasePoolThreadState::NO_EPOCH_SCOPE;
+            return;
+        }
+        state->inEpoch = false;
+        state->epoch.store(0, std::memory_order_release);
+        if (state->retired.size() >= state->reclaimAt) reclaimRetired(state);
+    }
+
+    // Move the global epoch on if every thread in a critical section
+    // has seen the current one.
+    static bool tryAdvanceEpoch() {
+        std::lock_guard<std::mutex> guard(registryLock);
+        uint64_t current = globalEpoch.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (AutoreleasePoolThreadState *state = registry; state; state = state->next) {
+            uint64_t seen = state->epoch.load(std::memory_order_relaxed);
+            if (seen != 0 && seen != current) return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        globalEpoch.store(current + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Free the thread's retired nodes, and orphaned ones, that no
+    // critical section can still see: those retired two or more epochs
+    // ago. Returns the number freed.
+    static size_t reclaimRetired(AutoreleasePoolThreadState *state) {
+        // A thread that stays in a critical section holds the epoch
+        // back; don't retry on every retire until it moves.
+        state->reclaimAt = state->retired.size() + RETIRE_BATCH;
+        tryAdvanceEpoch();
+        uint64_t safe = globalEpoch.load(std::memory_order_acquire);
+        if (safe < 2) return 0;
+        safe -= 2;
+
+        std::vector<AutoreleasePoolThreadState::RetiredNode> dead;
+        std::vector<AutoreleasePoolThreadState::RetiredNode> &retired = state->retired;
+        size_t n = 0;
+        while (n < retired.size() && retired[n].epoch <= safe) n++;
+        dead.assign(retired.begin(), retired.begin() + n);
+        retired.erase(retired.begin(), retired.begin() + n);
+        state->reclaimAt = retired.size() + RETIRE_BATCH;
+        if (hasOrphanedNodes.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> guard(registryLock);
+            size_t m = 0;
+            while (m < orphanedNodes.size() && orphanedNodes[m].epoch <= safe) m++;
+            dead.insert(dead.end(), orphanedNodes.begin(), orphanedNodes.begin() + m);
+            orphanedNodes.erase(orphanedNodes.begin(), orphanedNodes.begin() + m);
+            hasOrphanedNodes.store(!orphanedNodes.empty(), std::memory_order_relaxed);
+        }
+
+        // Outside the lock and the list: a free function may retire.
+        for (const auto &node : dead) {
+            node.free(node.node);
+        }
+        return dead.size();
+    }
+
+    // Release pending entries until the budget runs out.
+    // Returns true once nothing is pending.
+    static bool drainPendingEntries(AutoreleasePoolThreadState *state, AutoreleasePoolDrainBudget budget) {
+        // A release that pushes, pops or autoreleases must not drain
+        // recursively.
+        if (state->draining) return !state->hasPending;
+        state->draining = true;
+
+        uint64_t deadline = budget.ns ? nowNs() + budget.ns : 0;
+        size_t released = 0;
+        while (true) {
+            if (budget.entries && released >= budget.entries) break;
+            // Reading the clock costs about as much as a release.
+            if (deadline && released && released % 16 == 0 && nowNs() >= deadline) break;
+
+            if (state->drainingScope == state->pendingScopes.size()) {
+                state->pendingScopes.clear();
+                state->pendingEntries.clear();
+                state->drainingScope = 0;
+                state->hasPending = false;
+                threadsWithPendingDrain.fetch_sub(1, std::memory_order_relaxed);
+                break;
+            }
+
+            // Releases below may popIncremental() and grow pendingScopes,
+            // so `scope` isn't used past them.
+            AutoreleasePoolThreadState::PendingScope &scope = state->pendingScopes[state->drainingScope];
+            id obj;
+            uintptr_t releases;
+            if (AutoreleasePoolPage *page = scope.top) {
+                if (page->empty()) {
+                    scope.top = page == scope.bottom ? nil : page->parent;
+                    page->unprotect();
+                    page->child = nil;
+                    size_t size = page->chunkSize();
+                    page->~AutoreleasePoolPage();
+                    freeChunk(page, size);
+                    continue;
+                }
+                page->unprotect();
+                id *slot = --page->next;
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+                obj = entryObject(slot);
+                releases = page->entryCount(slot) + 1;
+#else
+                obj = *slot;
+                releases = 1;
+#endif
+                memset((void *)slot, SCRIBBLE, sizeof(*slot));
+                page->poison(slot, slot + 1);
+                page->protect();
+                if (obj == POOL_BOUNDARY) continue;
+            } else if (scope.entries) {
+                const AutoreleasePoolThreadState::PendingEntry &entry = state->pendingEntries[scope.firstEntry + --scope.entries];
+                obj = entry.obj;
+                releases = entry.releases;
+            } else {
+                std::vector<ScopeArena::Destructor> destructors = std::move(scope.destructors);
+                bool leavesEpoch = scope.leavesEpoch;
+                state->drainingScope++;
+                ScopeArena::runDestructors(destructors);
+                if (leavesEpoch && --state->epochPendingScopes == 0 &&
+                    state->epochScopePosition == AutoreleasePoolThreadState::NO_EPOCH_SCOPE) {
+                    leaveEpoch(state, 0);
+                }
+                continue;
+            }
+
+            releaseEntry(obj, releases);
+            released++;
+        }
+
+        state->draining = false;
+        return !state->hasPending;
+    }
+
+    static const uintptr_t CXX_ENTRY = 1;
+    static const uintptr_t CXX_SHARED = 2;
+    static const size_t CXX_RECORD_CHUNK = 4096;
+
+    static inline bool isCxxEntry(id obj) {
+        return (uintptr_t)obj & CXX_ENTRY;
+    }
+
+    static inline AutoreleasePoolCxxRecord *cxxRecord(id obj) {
+        return (AutoreleasePoolCxxRecord *)((uintptr_t)obj & ~(CXX_ENTRY | CXX_SHARED));
+    }
+
+    static AutoreleasePoolCxxRecord *allocCxxRecord(AutoreleasePoolThreadState *state) {
+        if (slowpath(!state->freeCxxRecords)) {
+            size_t count = CXX_RECORD_CHUNK / sizeof(AutoreleasePoolCxxRecord);
+            AutoreleasePoolCxxRecord *chunk = (AutoreleasePoolCxxRecord *)
+                aligned_alloc(alignof(AutoreleasePoolCxxRecord), CXX_RECORD_CHUNK);
+            state->cxxRecordChunks.push_back(chunk);
+            for (size_t i = 0; i < count; i++) {
+                chunk[i].next = i + 1 < count ? &chunk[i + 1] : nil;
+            }
+            state->freeCxxRecords = chunk;
+        }
+        AutoreleasePoolCxxRecord *record = state->freeCxxRecords;
+        state->freeCxxRecords = record->next;
+        return record;
+    }
+
+    static inline void addCxxEntry(AutoreleasePoolCxxRecord *record, uintptr_t kind) {
+        entryPoints.autoreleaseCxx((id)((uintptr_t)record | kind));
+    }
+
+    // The record goes back on the free list before the pointer is
+    // destroyed, which may autorelease more of them.
+    static __attribute__((noinline)) void releaseCxxEntry(id obj) {
+        AutoreleasePoolThreadState *state = threadState();
+        AutoreleasePoolCxxRecord *record = cxxRecord(obj);
+        if ((uintptr_t)obj & CXX_SHARED) {
+            std::shared_ptr<void> owner = std::move(*record->sharedPtr());
+            record->sharedPtr()->~shared_ptr();
+            record->next = state->freeCxxRecords;
+            state->freeCxxRecords = record;
+        } else {
+            void *ptr = record->unique.ptr;
+            void (*destroy)(void *) = record->unique.destroy;
+            record->next = state->freeCxxRecords;
+            state->freeCxxRecords = record;
+            destroy(ptr);
+        }
+    }
+
+    static bool takeTrimRequest(AutoreleasePoolThreadState *state) {
+        if (!state->trimRequested.load(std::memory_order_relaxed) ||
+            !state->trimRequested.exchange(false, std::memory_order_relaxed)) {
+            return false;
+        }
+        threadsWithTrimRequest.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Free the spare pages above the hot page if memory pressure asked
+    // this thread to.
+    static inline void trimIfRequested() {
+        if (slowpath(threadsWithTrimRequest.load(std::memory_order_relaxed) != 0)) {
+            trimSparePagesIfRequested();
+        }
+    }
+
+    static __attribute__((noinline, cold)) void trimSparePagesIfRequested() {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state || !takeTrimRequest(state)) return;
+        claimSparePages();
+        AutoreleasePoolPage *page = hotPage();
+        if (page && page->child) page->child->kill();
+    }
+
+    static inline void drainPendingIfNeeded() {
+        if (slowpath(threadsWithPendingDrain.load(std::memory_order_relaxed) != 0)) {
+            drainPendingSlice();
+        }
+    }
+
+    static __attribute__((noinline, cold)) void drainPendingSlice() {
+        AutoreleasePoolThreadState *state = threadState();
+        if (state && state->hasPending) {
+            drainPendingEntries(state, state->drainBudget);
+        }
+    }
+
+    static inline AutoreleasePoolThreadState *threadState() {
+        return (AutoreleasePoolThreadState *)tls_get_direct(stateKey);
+    }
+
+    static __attribute__((noinline)) RefCountMergeQueue *installRefCountQueue() {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        if (!state->refCountQueue) state->refCountQueue = new RefCountMergeQueue();
+        return state->refCountQueue;
+    }
+
+    static __attribute__((noinline)) AutoreleasePoolThreadState *installThreadState() {
+        AutoreleasePoolThreadState *state = new AutoreleasePoolThreadState();
+        state->sampleCountdown = (int64_t)samplePeriod;
+        state->reclaimAt = RETIRE_BATCH;
+#if TRACK_AUTORELEASEPOOL_SCOPES
+        state->scopeDepth = 0;
+        state->scopeStats = new AutoreleasePoolScopeStats();
+#endif
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            state->prev = nil;
+            state->next = registry;
+            if (registry) registry->prev = state;
+            registry = state;
+        }
+        tls_set_direct(stateKey, state);
+        return state;
+    }
+
+    static void state_dealloc(void *p) {
+        AutoreleasePoolThreadState *state = (AutoreleasePoolThreadState *)p;
+        if (state->hasPending) drainPendingEntries(state, {0, 0});
+        // Pages don't outlive their directory. They are normally gone
+        // already, unless the pool key's destructor hasn't run yet or
+        // a release above autoreleased into a new pool.
+        void *pool = tls_get_direct(key);
+        if (pool && pool != (void *)EMPTY_POOL_PLACEHOLDER) tls_dealloc(pool);
+        if (state->epochRegistered) {
+            state->inEpoch = false;
+            state->epoch.store(0, std::memory_order_release);
+            epochThreads.fetch_sub(1, std::memory_order_release);
+        }
+        if (!state->retired.empty()) reclaimRetired(state);
+        std::vector<AutoreleasePoolThreadState::RetiredNode> dead;
+        // Objects merged here may release others and create a new queue.
+        while (RefCountMergeQueue *queue = state->refCountQueue) {
+            state->refCountQueue = nil;
+            RefCounted::queueExited(queue);
+        }
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            // Nodes that aren't safe to free yet wait for another
+            // thread's reclaimRetired(). Both lists are in epoch order.
+            // Once no thread is registered nothing can be reading them,
+            // so the last thread out frees them all. Checked under the
+            // lock so that a thread orphaning nodes and the last
+            // registered thread leaving can't miss each other.
+            if (epochThreads.load(std::memory_order_acquire) == 0) {
+                dead.swap(orphanedNodes);
+                dead.insert(dead.end(), state->retired.begin(), state->retired.end());
+                hasOrphanedNodes.store(false, std::memory_order_relaxed);
+            } else if (!state->retired.empty()) {
+                size_t middle = orphanedNodes.size();
+                orphanedNodes.insert(orphanedNodes.end(), state->retired.begin(), state->retired.end());
+                std::inplace_merge(orphanedNodes.begin(), orphanedNodes.begin() + middle, orphanedNodes.end(),
+                                   [](const auto &a, const auto &b) { return a.epoch < b.epoch; });
+                hasOrphanedNodes.store(true, std::memory_order_relaxed);
+            }
+            if (state->prev) state->prev->next = state->next;
+            else registry = state->next;
+            if (state->next) state->next->prev = state->prev;
+            takeTrimRequest(state);
+            if (AutoreleaseSampleTable *samples = state->samples.load(std::memory_order_acquire)) {
+                if (!exitedSamples) exitedSamples = new AutoreleaseSampleTable();
+                samples->mergeInto(exitedSamples);
+            }
+#if TRACK_AUTORELEASEPOOL_SCOPES
+            if (!exitedScopeStats) exitedScopeStats = new AutoreleasePoolScopeStats();
+            exitedScopeStats->merge(*state->scopeStats);
+#endif
+        }
+        for (const auto &node : dead) {
+            node.free(node.node);
+        }
+        tls_set_direct(stateKey, nil);
+        free(state->pages);
+        for (AutoreleasePoolCxxRecord *chunk : state->cxxRecordChunks) free(chunk);
+        delete state->samples.load(std::memory_order_relaxed);
+#if TRACK_AUTORELEASEPOOL_SCOPES
+        delete state->scopeStats;
+#endif
+        delete state;
+    }
+
+    // Spare pages above the hot page are published so that a memory
+    // pressure handler on another thread can free them. The owner must
+    // take them back before it touches any page above the hot page.
+    static inline void publishSparePages(AutoreleasePoolPage *page) {
+        ASSERT(page == hotPage());
+        if (AutoreleasePoolThreadState *state = threadState()) {
+            state->spareRoot.store(page, std::memory_order_release);
+        }
+    }
+
+    static inline void claimSparePages() {
+        AutoreleasePoolThreadState *state = threadState();
+        if (state && state->spareRoot.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> guard(state->lock);
+            state->spareRoot.store(nil, std::memory_order_relaxed);
+        }
+    }
+
+    // Free the spare pages that another thread has published.
+    // Returns the number of pages freed, in pages of SIZE.
+    static size_t reclaimSparePages(AutoreleasePoolThreadState *state) {
+#if PROTECT_AUTORELEASEPOOL
+        // Protected pages can't be touched behind the owner's back;
+        // leave them to the owner's next pop.
+        return 0;
+#else
+        AutoreleasePoolPage *page;
+        {
+            std::lock_guard<std::mutex> guard(state->lock);
+            AutoreleasePoolPage *root = state->spareRoot.load(std::memory_order_acquire);
+            if (!root) return 0;
+            page = root->child;
+            root->child = nil;
+            state->pageCount.store(root->depth + 1, std::memory_order_relaxed);
+            state->spareRoot.store(nil, std::memory_order_release);
+        }
+
+        size_t count = 0;
+        while (page) {
+            AutoreleasePoolPage *deathptr = page;
+            page = page->child;
+            // ~AutoreleasePoolPage() insists on running on the owning
+            // thread, so do its work by hand.
+            ASSERT(deathptr->empty());
+            size_t size = deathptr->chunkSize();
+            deathptr->magic.~magic_t();
+            freeChunk(deathptr, size);
+            count += size / SIZE;
+        }
+        return count;
+#endif
+    }
+
+    // Charge n autoreleases (or n bytes of page growth) against the
+    // current thread's sampling countdown. Always inlined, so that
+    // recordSample()'s caller is the pool function that sampled.
+    static inline __attribute__((always_inline)) void countForSampling(uint64_t n) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (state && (state->sampleCountdown -= (int64_t)n) <= 0) {
+            recordSample(state);
+        }
+    }
+
+    static __attribute__((noinline, cold)) void recordSample(AutoreleasePoolThreadState *state) {
+        // One sample stands for every event since the previous one.
+        uint64_t weight = samplePeriod - (uint64_t)state->sampleCountdown;
+        state->sampleCountdown = (int64_t)samplePeriod;
+        if (!samplePeriod) return;  // sampling was switched off
+
+        void *frames[AutoreleaseSampleTable::MAX_FRAMES + 1];
+        int depth = backtrace(frames, AutoreleaseSampleTable::MAX_FRAMES + 1);
+        // Skip recordSample() only. countForSampling() is always inlined,
+        // so the next frame is already the pool function that sampled.
+        int skip = depth < 1 ? depth : 1;
+        AutoreleaseSampleTable *samples = state->samples.load(std::memory_order_relaxed);
+        if (!samples) {
+            samples = new AutoreleaseSampleTable();
+            state->samples.store(samples, std::memory_order_release);
+        }
+        samples->record(frames + skip, depth - skip, weight);
+    }
+
+    static AutoreleasePoolPage *pageForPointer(const void *p) {
+        return pageForPointer((uintptr_t)p);
+    }
+
+    // p's page starts at p rounded down to one of the chunk sizes.
+    // Trying them smallest first only reads inside that page: a rounded
+    // address that isn't its start is a slot at or below p. A slot can
+    // hold a word that looks like magic.M0 (C++ records are stored with
+    // their low bits set), so a probe is only taken as the page start if
+    // the whole magic matches and the header's depth is one that is
+    // allocated with this chunk size.
+    static bool isPageStart(const AutoreleasePoolPage *page, unsigned cls) {
+        return page->magic.m[0] == magic_t::M0 && page->magic.check() &&
+               chunkClass(page->depth) == cls;
+    }
+
+    static AutoreleasePoolPage *pageForPointer(uintptr_t p) {
+        AutoreleasePoolPage *result;
+        unsigned cls = 0;
+        while (true) {
+            result = (AutoreleasePoolPage *)(p & ~(CHUNK_SIZES[cls] - 1));
+            if (cls == CHUNK_CLASSES - 1 || isPageStart(result, cls)) break;
+            cls++;
+        }
+
+        ASSERT(p - (uintptr_t)result >= sizeof(AutoreleasePoolPage));
+        ASSERT(p - (uintptr_t)result < result->chunkSize());
+
+        result->fastcheck();
+
+        return result;
+    }
+
+    static inline bool haveEmptyPoolPlaceholder() {
+        id *tls = (id *)tls_get_direct(key);
+        return (tls == EMPTY_POOL_PLACEHOLDER);
+    }
+
+    static inline id *setEmptyPoolPlaceholder() {
+        ASSERT(tls_get_direct(key) == nil);
+        tls_set_direct(key, (void *)EMPTY_POOL_PLACEHOLDER);
+        return EMPTY_POOL_PLACEHOLDER;
+    }
+
+    static inline AutoreleasePoolPage *hotPage() {
+        AutoreleasePoolPage *result = (AutoreleasePoolPage *)
+            tls_get_direct(key);
+        if ((id *)result == EMPTY_POOL_PLACEHOLDER) return nil;
+        if (result) result->fastcheck();
+        return result;
+    }
+
+    static inline void setHotPage(AutoreleasePoolPage *page) {
+        if (page) page->fastcheck();
+        tls_set_direct(key, (void *)page);
+    }
+
+    static inline AutoreleasePoolPage *coldPage() {
+        AutoreleasePoolPage *result = hotPage();
+        if (result && result->parent) {
+            result = threadState()->pages[0];
+            result->fastcheck();
+        }
+        return result;
+    }
+
+#if SUPPORT_RETURN_AUTORELEASE
+    // The object most recently returned by autoreleaseReturnValue(),
+    // until its caller claims it. It belongs in the hot pool, so push
+    // and pop put it there before they change which pool that is.
+    // Plain autoreleases go to the same pool and can leave it alone.
+    static inline id pendingReturnValue() {
+        return (id)tls_get_direct(returnKey);
+    }
+
+    static inline void setPendingReturnValue(id obj) {
+        tls_set_direct(returnKey, (void *)obj);
+    }
+
+    static __attribute__((noinline)) void flushReturnValueSlow() {
+        id obj = pendingReturnValue();
+        setPendingReturnValue(nil);
+        entryPoints.autorelease(obj);
+    }
+
+    // Unclaimed at thread exit: pools are gone, so drop it here.
+    static void return_dealloc(void *p) {
+        tls_set_direct(returnKey, nil);
+        Releaser::release((id)p);
+    }
+#endif
+
+    static inline void flushReturnValue() {
+#if SUPPORT_RETURN_AUTORELEASE
+        if (slowpath(pendingReturnValue())) flushReturnValueSlow();
+#endif
+    }
+
+    template <unsigned Opts>
+    static inline id *autoreleaseFast(id obj) {
+        AutoreleasePoolPage *page = hotPage();
+        if (page && !page->full()) {
+            return page->add<Opts>(obj);
+        } else if (page) {
+            return autoreleaseFullPage<Opts>(obj, page);
+        } else {
+            return autoreleaseNoPage<Opts>(obj);
+        }
+    }
+
+    template <unsigned Opts>
+    static __attribute__((noinline))
+    id *
+    autoreleaseFullPage(id obj, AutoreleasePoolPage *page) {
+        // The hot page is full.
+        // Step to the next non-full page, adding a new page if necessary.
+        // Then add the object to that page.
+        ASSERT(page == hotPage());
+        ASSERT(page->full() || (Opts & OptDebugPoolAllocation));
+
+        claimSparePages();
+        do {
+            if (page->child)
+                page = page->child;
+            else
+                page = newPage(page);
+        } while (page->full());
+
+        setHotPage(page);
+        trimIfRequested();
+        return page->add<Opts>(obj);
+    }
+
+    template <unsigned Opts>
+    static __attribute__((noinline))
+    id *
+    autoreleaseNoPage(id obj) {
+        // "No page" could mean no pool has been pushed
+        // or an empty placeholder pool has been pushed and has no contents yet
+        ASSERT(!hotPage());
+
+        bool pushExtraBoundary = false;
+        if (haveEmptyPoolPlaceholder()) {
+            // We are pushing a second pool over the empty placeholder pool
+            // or pushing the first object into the empty placeholder pool.
+            // Before doing that, push a pool boundary on behalf of the pool
+            // that is currently represented by the empty placeholder.
+            pushExtraBoundary = true;
+        } else if (obj != POOL_BOUNDARY && (Opts & OptDebugMissingPools)) {
+            // We are pushing an object with no pool in place,
+            // and no-pool debugging was requested by environment.
+            //            _objc_inform("MISSING POOLS: (%p) Object %p of class %s "
+            //                         "autoreleased with no pool in place - "
+            //                         "just leaking - break on "
+            //                         "objc_autoreleaseNoPool() to debug",
+            //                         objc_thread_self(), (void *)obj, object_getClassName(obj));
+            //            objc_autoreleaseNoPool(obj);
+            return nil;
+        } else if (obj == POOL_BOUNDARY && !(Opts & OptDebugPoolAllocation)) {
+            // We are pushing a pool with no pool in place,
+            // and alloc-per-pool debugging was not requested.
+            // Install and return the empty pool placeholder.
+            return setEmptyPoolPlaceholder();
+        }
+
+        // We are pushing an object or a non-placeholder'd pool.
+
+        if (!threadState()) installThreadState();
+
+        // Install the first page.
+        AutoreleasePoolPage *page = newPage(nil);
+        setHotPage(page);
+
+        // Push a boundary on behalf of the previously-placeholder'd pool.
+        if (pushExtraBoundary) {
+            page->add<Opts>(POOL_BOUNDARY);
+        }
+
+        // Push the requested object or pool.
+        return page->add<Opts>(obj);
+    }
+
+    template <unsigned Opts>
+    static __attribute__((noinline))
+    id *
+    autoreleaseNewPage(id obj) {
+        AutoreleasePoolPage *page = hotPage();
+        if (page)
+            return autoreleaseFullPage<Opts>(obj, page);
+        else
+            return autoreleaseNoPage<Opts>(obj);
+    }
+
+    // Give a thread whose pool is still the empty placeholder, or that
+    // has no pool, its first page. The thread state must exist.
+    static __attribute__((noinline)) AutoreleasePoolPage *installFirstPage() {
+        bool pushExtraBoundary = haveEmptyPoolPlaceholder();
+        AutoreleasePoolPage *page = newPage(nil);
+        setHotPage(page);
+        // Stand in for the pool that the placeholder represents,
+        // as autoreleaseNoPage() would.
+        if (pushExtraBoundary) page->add<0>(POOL_BOUNDARY);
+        return page;
+    }
+
+    // Grow the current thread's page chain until the hot page and the
+    // spare pages above it hold at least `pages` pages and `entries` free
+    // slots, and fault all of it in. Returns the depth just above the
+    // last page, which the caller keeps from being freed by pops.
+    static __attribute__((noinline)) uint32_t reserveCapacity(size_t pages, size_t entries) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+
+        AutoreleasePoolPage *hot = hotPage();
+        if (!hot) hot = installFirstPage();
+
+        claimSparePages();
+        hot->prefault();
+        AutoreleasePoolPage *page = hot;
+        size_t havePages = 1;
+        size_t haveEntries = hot->end() - hot->next;
+        while (havePages < pages || haveEntries < entries) {
+            page = page->child ? page->child : newPage(page);
+            page->prefault();
+            havePages++;
+            haveEntries += page->end() - page->begin();
+        }
+
+        if (hot->child) publishSparePages(hot);
+        return page->depth + 1;
+    }
+
+    // Drop the reservations of push(expectedEntries) pools whose boundary
+    // is at or above slot index `position`.
+    static void releaseReservations(AutoreleasePoolThreadState *state, size_t position) {
+        std::vector<AutoreleasePoolThreadState::ReservedScope> &scopes = state->reservedScopes;
+        while (!scopes.empty() && scopes.back().position >= position) scopes.pop_back();
+    }
+
+    template <unsigned Opts>
+    static id autoreleaseWith(id obj) {
+        if (_objc_isTaggedPointerOrNil(obj) || Releaser::isImmortal(obj)) return obj;
+        drainPendingIfNeeded();
+        if (slowpath(sampleMode == AutoreleaseSampleMode::Count)) {
+            countForSampling(1);
+        }
+        id *dest __unused = autoreleaseFast<Opts>(obj);
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+        ASSERT(!dest || dest == EMPTY_POOL_PLACEHOLDER || entryObject(dest) == obj);
+#else
+        ASSERT(!dest || dest == EMPTY_POOL_PLACEHOLDER || *dest == obj);
+#endif
+        return obj;
+    }
+
+    template <unsigned Opts>
+    static id autoreleaseNWith(id obj, uintptr_t n) {
+        if (n == 0 || _objc_isTaggedPointerOrNil(obj) || Releaser::isImmortal(obj)) return obj;
+        drainPendingIfNeeded();
+        if (slowpath(sampleMode == AutoreleaseSampleMode::Count)) {
+            countForSampling(n);
+        }
+
+        // The first autorelease takes the normal path so that missing
+        // pools and the empty pool placeholder are handled as usual.
+        if (!autoreleaseFast<Opts>(obj)) return obj;
+        n--;
+
+        while (n > 0) {
+            AutoreleasePoolPage *page = hotPage();
+            if (page->full()) {
+                autoreleaseFullPage<Opts>(obj, page);
+                n--;
+            } else {
+                page->addN<Opts>(obj, n);
+            }
+        }
+        return obj;
+    }
+
+    // autoreleaseWith() for a C++ record entry. The entry looks like a
+    // tagged pointer but must be added, and it is never coalesced: every
+    // record is a distinct entry.
+    template <unsigned Opts>
+    static void autoreleaseCxxWith(id entry) {
+        drainPendingIfNeeded();
+        if (slowpath(sampleMode == AutoreleaseSampleMode::Count)) {
+            countForSampling(1);
+        }
+        autoreleaseFast<Opts & ~(OptCoalesce | OptCoalesceLRU)>(entry);
+    }
+
+    template <unsigned Opts>
+    static void *pushWith() {
+        flushReturnValue();
+        drainPendingIfNeeded();
+        trimIfRequested();
+        id *dest;
+        if constexpr (Opts & OptDebugPoolAllocation) {
+            // Each autorelease pool starts on a new pool page.
+            dest = autoreleaseNewPage<Opts>(POOL_BOUNDARY);
+        } else {
+            dest = autoreleaseFast<Opts>(POOL_BOUNDARY);
+        }
+        ASSERT(dest == EMPTY_POOL_PLACEHOLDER || *dest == POOL_BOUNDARY);
+#if TRACK_AUTORELEASEPOOL_SCOPES
+        recordScopeStart(dest);
+#endif
+        if constexpr (Opts & OptDebugPoolOrder) {
+            pushLiveScope(dest);
+        }
+        if (slowpath(epochThreads.load(std::memory_order_relaxed) != 0)) {
+            enterEpoch(dest);
+        }
+        return dest;
+    }
+
+    static void pushLiveScope(void *token) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        state->liveScopes.push_back(token);
+    }
+
+    // Popping a pool also pops every pool pushed after it, so a good
+    // token is found after passing only scopes that are being popped.
+    // The token itself is never dereferenced: its page may be gone.
+    // Returns false, leaving the stack alone, if token isn't open.
+    static bool popLiveScope(void *token) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) return false;
+        std::vector<void *> &scopes = state->liveScopes;
+        size_t i = scopes.size();
+        while (i > 0 && scopes[i - 1] != token) {
+            i--;
+        }
+        if (i == 0) return false;
+        scopes.resize(i - 1);
+        return true;
+    }
+
+    __attribute__((noinline, cold)) static void badPopOrder(void *token) {
+        AutoreleasePoolThreadState *state = threadState();
+        void *innermost = state && !state->liveScopes.empty() ? state->liveScopes.back() : nil;
+        fprintf(stderr, "objc[%d]: autorelease pool %p popped out of order or twice; "
+                        "the innermost open pool is %p\n",
+                getpid(), token, innermost);
+        badPop(token);
+    }
+
+    __attribute__((noinline, cold)) static void badPop(void *token) {
+        // Error. For bincompat purposes this is not
+        // fatal in executables built with old SDKs.
+
+        //        if (DebugPoolAllocation || sdkIsAtLeast(10_12, 10_0, 10_0, 3_0, 2_0)) {
+        //            // OBJC_DEBUG_POOL_ALLOCATION or new SDK. Bad pop is fatal.
+        //            _objc_fatal
+        //                ("Invalid or prematurely-freed autorelease pool %p.", token);
+        //        }
+
+        // Old SDK. Bad pop is warned once.
+        static bool complained = false;
+        if (!complained) {
+            complained = true;
+            //            _objc_inform_now_and_on_crash("Invalid or prematurely-freed autorelease pool %p. "
+            //                                          "Set a breakpoint on objc_autoreleasePoolInvalid to debug. "
+            //                                          "Proceeding anyway because the app is old. Memory errors "
+            //                                          "are likely.",
+            //                                          token);
+        }
+        //        objc_autoreleasePoolInvalid(token);
+    }
+
+    template <bool allowDebug>
+    static void
+    popPage(void *token, AutoreleasePoolPage *page, id *stop) {
+        if (allowDebug && PrintPoolHiwat) printHiwat();
+
+        claimSparePages();
+        AutoreleasePoolThreadState *state = threadState();
+        if (slowpath(state && state->hasPending)) {
+            drainPendingWithin(state, positionOf(page, stop));
+        }
+#if TRACK_AUTORELEASEPOOL_SCOPES
+        size_t entries = entriesAbove(page, stop);
+        uint64_t drainStart = nowNs();
+#endif
+        if (slowpath(coalescedDrainThreshold) && entriesAbove(page, stop) >= coalescedDrainThreshold) {
+            page->releaseUntilCoalesced(stop);
+        }
+        page->releaseUntil(stop);
+#if TRACK_AUTORELEASEPOOL_SCOPES
+        recordScopeEnd(token, entries, nowNs() - drainStart);
+#endif
+
+        if (slowpath(state && !state->arenaScopes.empty())) {
+            releaseScopedAllocations(state, positionOf(page, stop) + 1);
+        }
+        if (slowpath(state && !state->reservedScopes.empty())) {
+            releaseReservations(state, positionOf(page, stop));
+        }
+        if (slowpath(state && state->inEpoch)) {
+            leaveEpoch(state, positionOf(page, stop));
+        }
+
+        // memory: delete empty children
+        if (allowDebug && DebugPoolAllocation && page->empty()) {
+            // special case: delete everything during page-per-pool debugging
+            AutoreleasePoolPage *parent = page->parent;
+            page->kill();
+            setHotPage(parent);
+        } else if (allowDebug && DebugMissingPools && page->empty() && !page->parent) {
+            // special case: delete everything for pop(top)
+            // when debugging missing autorelease pools
+            page->kill();
+            setHotPage(nil);
+        } else if (page->child) {
+            if (slowpath(state && takeTrimRequest(state))) {
+                page->child->kill();
+            } else {
+                page->killUnretainedChildren();
+                if (page->child) publishSparePages(page);
+            }
+        }
+    }
+
+    __attribute__((noinline, cold)) static void
+    popPageDebug(void *token, AutoreleasePoolPage *page, id *stop) {
+        popPage<true>(token, page, stop);
+    }
+
+    template <unsigned Opts>
+    static void
+    popWith(void *token) {
+        flushReturnValue();
+        drainPendingIfNeeded();
+        if constexpr (Opts & OptDebugPoolOrder) {
+            if (!popLiveScope(token)) return badPopOrder(token);
+        }
+        AutoreleasePoolPage *page;
+        id *stop;
+        if (token == (void *)EMPTY_POOL_PLACEHOLDER) {
+            // Popping the top-level placeholder pool.
+            page = hotPage();
+            if (!page) {
+                // Pool was never used. Clear the placeholder.
+#if TRACK_AUTORELEASEPOOL_SCOPES
+                recordScopeEnd(token, 0, 0);
+#endif
+                leaveEpochIfNeeded(0);
+                return setHotPage(nil);
+            }
+            // Pool was used. Pop its contents normally.
+            // Pool pages remain allocated for re-use as usual.
+            page = coldPage();
+            stop = page->begin();
+        } else {
+            page = pageForPointer(token);
+            stop = (id *)token;
+        }
+
+        if (*stop != POOL_BOUNDARY) {
+            if (stop == page->begin() && !page->parent) {
+                // Start of coldest page may correctly not be POOL_BOUNDARY:
+                // 1. top-level pool is popped, leaving the cold page in place
+                // 2. an object is autoreleased with no pool
+            } else {
+                // Error. For bincompat purposes this is not
+                // fatal in executables built with old SDKs.
+                return badPop(token);
+            }
+        }
+
+        if constexpr (Opts & (OptPrintPoolHiwat | OptDebugPoolAllocation | OptDebugMissingPools)) {
+            return popPageDebug(token, page, stop);
+        }
+
+        return popPage<false>(token, page, stop);
+    }
+
+    static unsigned currentOptions() {
+        unsigned opts = 0;
+        if (!DisableAutoreleaseCoalescing || !DisableAutoreleaseCoalescingLRU) opts |= OptCoalesce;
+        if (!DisableAutoreleaseCoalescingLRU) opts |= OptCoalesceLRU;
+        if (DebugPoolAllocation) opts |= OptDebugPoolAllocation;
+        if (DebugMissingPools) opts |= OptDebugMissingPools;
+        if (PrintPoolHiwat) opts |= OptPrintPoolHiwat;
+        if (DebugPoolOrder) opts |= OptDebugPoolOrder;
+        return opts;
+    }
+
+  public:
+    template <unsigned Opts>
+    static constexpr EntryPoints entryPointsFor() {
+        return {&autoreleaseWith<Opts>, &autoreleaseNWith<Opts>, &autoreleaseCxxWith<Opts>, &pushWith<Opts>, &popWith<Opts>};
+    }
+
+    static inline id autorelease(id obj) {
+        return entryPoints.autorelease(obj);
+    }
+
+    // The part of autorelease() that callers in other images can inline:
+    // a TLS load, a full() check and add(). A new page, sampling and
+    // pending drains go out of line.
+    static inline id autoreleaseInline(id obj) {
+#if LOG_AUTORELEASEPOOL || PROTECT_AUTORELEASEPOOL
+        return autorelease(obj);
+#else
+        if (_objc_isTaggedPointerOrNil(obj) || Releaser::isImmortal(obj)) return obj;
+        AutoreleasePoolPage *page = hotPage();
+        if (fastpath(page && !page->full() &&
+                     sampleMode == AutoreleaseSampleMode::Off &&
+                     threadsWithPendingDrain.load(std::memory_order_relaxed) == 0)) {
+            switch (options & (OptCoalesce | OptCoalesceLRU)) {
+            case OptCoalesce | OptCoalesceLRU:
+                page->add<OptCoalesce | OptCoalesceLRU>(obj);
+                return obj;
+            case OptCoalesce:
+                page->add<OptCoalesce>(obj);
+                return obj;
+            case 0:
+                page->add<0>(obj);
+                return obj;
+            }
+        }
+        return autorelease(obj);
+#endif
+    }
+
+    // Autorelease obj n times. Coalesced entries get their count written
+    // directly, so this costs one page write per maxCount+1 autoreleases
+    // and one releaseN() per entry when the pool is drained.
+    static inline id autorelease(id obj, uintptr_t n) {
+        return entryPoints.autoreleaseN(obj, n);
+    }
+
+    // Move ownership of p into the pool, which destroys the object when
+    // the pool is popped. Returns the object, valid until then. The
+    // deleter must be stateless: it is default-constructed to run.
+    template <typename T, typename D>
+    static typename std::unique_ptr<T, D>::pointer autorelease(std::unique_ptr<T, D> &&p) {
+        typedef typename std::unique_ptr<T, D>::pointer pointer;
+        static_assert(std::is_pointer_v<pointer>, "the pool only keeps raw pointers");
+        static_assert(std::is_empty_v<D> && std::is_default_constructible_v<D>,
+                      "the pool can't keep a deleter with state");
+        pointer ptr = p.get();
+        if (!ptr) return ptr;
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        AutoreleasePoolCxxRecord *record = allocCxxRecord(state);
+        record->unique.ptr = (void *)p.release();
+        record->unique.destroy = [](void *ptr) { D()((pointer)ptr); };
+        addCxxEntry(record, CXX_ENTRY);
+        return ptr;
+    }
+
+    // Move p into the pool without touching its reference count; the
+    // reference is dropped when the pool is popped. If the pool's last
+    // entry already shares ownership with p, p's reference is dropped
+    // now instead: it can't be the last one, so it costs the same
+    // decrement and saves an entry. Returns the stored pointer.
+    template <typename T>
+    static T *autorelease(std::shared_ptr<T> &&p) {
+        T *ptr = p.get();
+        if (p.use_count() == 0) return ptr;
+
+        AutoreleasePoolPage *hot = hotPage();
+        if (hot && !hot->empty()) {
+            id top = entryObject(hot->next - 1);
+            if (((uintptr_t)top & (CXX_ENTRY | CXX_SHARED)) == (CXX_ENTRY | CXX_SHARED)) {
+                std::shared_ptr<void> *held = cxxRecord(top)->sharedPtr();
+                if (!held->owner_before(p) && !p.owner_before(*held)) {
+                    p.reset();
+                    return ptr;
+                }
+            }
+        }
+
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        AutoreleasePoolCxxRecord *record = allocCxxRecord(state);
+        new (record->shared) std::shared_ptr<void>(std::move(p));
+        addCxxEntry(record, CXX_ENTRY | CXX_SHARED);
+        return ptr;
+    }
+
+    static inline void *push() {
+        return entryPoints.push();
+    }
+
+    static inline void pop(void *token) {
+        entryPoints.pop(token);
+    }
+
+    // Autorelease obj on its way out of a function. If the caller takes
+    // it with retainAutoreleasedReturnValue() before any other pool
+    // operation on this thread, the autorelease and the retain cancel
+    // out and obj never goes into a pool page.
+    static id autoreleaseReturnValue(id obj) {
+#if SUPPORT_RETURN_AUTORELEASE
+        if (_objc_isTaggedPointerOrNil(obj) || Releaser::isImmortal(obj)) return obj;
+        flushReturnValue();
+        setPendingReturnValue(obj);
+        return obj;
+#else
+        return autorelease(obj);
+#endif
+    }
+
+    // Retain a value returned by a function that may have used
+    // autoreleaseReturnValue().
+    static id retainAutoreleasedReturnValue(id obj) {
+#if SUPPORT_RETURN_AUTORELEASE
+        if (obj && pendingReturnValue() == obj) {
+            setPendingReturnValue(nil);
+            return obj;
+        }
+#endif
+        if (!_objc_isTaggedPointerOrNil(obj)) Releaser::retain(obj);
+        return obj;
+    }
+
+    // Push a pool with room for `expectedEntries` autoreleases already
+    // allocated and faulted in. The pages are kept until the pool is
+    // popped, then left to the retention policy.
+    static void *push(size_t expectedEntries) {
+        void *token = push();
+        uint32_t depth = reserveCapacity(0, expectedEntries);
+
+        // The placeholder pool got its boundary at the bottom of the
+        // first page when reserveCapacity() installed it.
+        AutoreleasePoolPage *page = token == (void *)EMPTY_POOL_PLACEHOLDER ? coldPage() : pageForPointer(token);
+        id *boundary = token == (void *)EMPTY_POOL_PLACEHOLDER ? page->begin() : (id *)token;
+        AutoreleasePoolThreadState *state = threadState();
+        std::vector<AutoreleasePoolThreadState::ReservedScope> &scopes = state->reservedScopes;
+        if (!scopes.empty() && scopes.back().depth > depth) depth = scopes.back().depth;
+        scopes.push_back({positionOf(page, boundary), depth});
+        return token;
+    }
+
+    // Set up at least nPages pool pages for the current thread, from the
+    // hot page up, so that filling them neither allocates nor faults.
+    // Call it when a worker thread starts. Reserved pages are kept until
+    // trim() or memory pressure frees them.
+    static void reserve(size_t nPages) {
+        if (!nPages) return;
+        uint32_t depth = reserveCapacity(nPages, 0);
+        AutoreleasePoolThreadState *state = threadState();
+        if (depth > state->reservedDepth) state->reservedDepth = depth;
+    }
+
+    // Memory that lives until the innermost pool on this thread is
+    // popped, from a per-thread bump arena. It takes no pool entry and
+    // is never freed on its own. With no pool in place it lives until
+    // the thread exits, like an object autoreleased with no pool.
+    // After popIncremental(), destructors run once the scope's objects
+    // have been released, and the memory is reclaimed with the
+    // enclosing scope.
+    static void *scopedAlloc(size_t size, size_t align = alignof(std::max_align_t)) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        AutoreleasePoolPage *hot = hotPage();
+        if (!hot) hot = installFirstPage();
+
+        size_t position = positionOf(hot, hot->next);
+        std::vector<AutoreleasePoolThreadState::ArenaScope> &scopes = state->arenaScopes;
+        if (scopes.empty() || scopes.back().position != position) {
+            ASSERT(scopes.empty() || scopes.back().position < position);
+            scopes.push_back({position, state->arena.mark()});
+        }
+        return state->arena.alloc(size, align);
+    }
+
+    // Construct a T with scopedAlloc(). Its destructor, unless trivial,
+    // runs when the pool is popped, after the pool's objects have been
+    // released; objects of one pool are destroyed newest first.
+    template <typename T, typename... Args>
+    static T *scopedNew(Args &&...args) {
+        T *object = new (scopedAlloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            threadState()->arena.addDestructor([](void *p) { ((T *)p)->~T(); }, object);
+        }
+        return object;
+    }
+
+    // Make the calling thread's outermost pool a critical section for
+    // retire(): nodes retired by any thread are not freed while a pool
+    // that was open when they were unlinked is still open. Call it
+    // outside any pool. Threads that never register must not read
+    // nodes that others retire.
+    static void registerForReclamation() {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        if (state->epochRegistered) return;
+        state->epochRegistered = true;
+        epochThreads.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Free node with `free` once no registered thread can still be
+    // reading it. Call it after node has been unlinked. Nodes are freed
+    // in batches on this thread, at retire(), when its outermost pool
+    // is popped, or at reclaim(). A registered thread that never pops
+    // its outermost pool keeps every node retired since from being
+    // freed.
+    static void retire(void *node, void (*free)(void *node)) {
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        // Tag the node with an epoch no earlier than its unlinking.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        state->retired.push_back({node, free, globalEpoch.load(std::memory_order_relaxed)});
+        if (state->retired.size() >= state->reclaimAt) reclaimRetired(state);
+    }
+
+    template <typename T>
+    static void retire(T *node) {
+        retire((void *)node, [](void *p) { delete (T *)p; });
+    }
+
+    // Free whatever the calling thread has retired that is safe to free
+    // now. Returns the number of nodes freed.
+    static size_t reclaim() {
+        AutoreleasePoolThreadState *state = threadState();
+        return state ? reclaimRetired(state) : 0;
+    }
+
+    // Pop the scope at once but leave releasing its objects to later
+    // push, pop and autorelease calls on this thread, `budget` at a time.
+    // New autoreleases go to the enclosing scope as if pop() had run.
+    // Until they are drained, objects in the scope stay alive; call
+    // drainPending() to release them all.
+    static void popIncremental(void *token, AutoreleasePoolDrainBudget budget) {
+        if (DebugPoolAllocation || DebugMissingPools || PrintPoolHiwat) {
+            // These modes need pop()'s page handling.
+            return pop(token);
+        }
+        flushReturnValue();
+        drainPendingIfNeeded();
+        if ((options & OptDebugPoolOrder) && !popLiveScope(token)) {
+            return badPopOrder(token);
+        }
+
+        AutoreleasePoolPage *page;
+#if TRACK_AUTORELEASEPOOL_SCOPES
+        void *const scope = token;
+#endif
+        if (token == (void *)EMPTY_POOL_PLACEHOLDER) {
+            page = hotPage();
+            if (!page) {
+#if TRACK_AUTORELEASEPOOL_SCOPES
+                recordScopeEnd(scope, 0, 0);
+#endif
+                leaveEpochIfNeeded(0);
+                return setHotPage(nil);
+            }
+            page = coldPage();
+            token = page->begin();
+        } else {
+            page = pageForPointer(token);
+        }
+
+        id *stop = (id *)token;
+        if (*stop != POOL_BOUNDARY && !(stop == page->begin() && !page->parent)) {
+            return badPop(token);
+        }
+
+        AutoreleasePoolThreadState *state = threadState();
+        if (!state) state = installThreadState();
+        state->drainBudget = budget;
+
+        size_t position = positionOf(page, stop);
+        std::vector<ScopeArena::Destructor> destructors;
+        if (!state->arenaScopes.empty()) {
+            destructors = detachScopedAllocations(state, position);
+        }
+        if (!state->reservedScopes.empty()) {
+            releaseReservations(state, position);
+        }
+        size_t pendingScopes = state->pendingScopes.size();
+#if TRACK_AUTORELEASEPOOL_SCOPES
+        size_t entries = entriesAbove(page, stop);
+        uint64_t unlinkStart = nowNs();
+        page->unlinkScope(stop, state, std::move(destructors));
+        recordScopeEnd(scope, entries, nowNs() - unlinkStart);
+#else
+        page->unlinkScope(stop, state, std::move(destructors));
+#endif
+        if (state->inEpoch && position <= state->epochScopePosition) {
+            if (state->pendingScopes.size() > pendingScopes) {
+                // Leave the section once the scope's objects are released.
+                state->pendingScopes.back().leavesEpoch = true;
+                state->epochPendingScopes++;
+                state->epochScopePosition = AutoreleasePoolThreadState::NO_EPOCH_SCOPE;
+            } else {
+                leaveEpoch(state, position);
+            }
+        }
+    }
+
+    // Release everything that popIncremental() left behind on this thread.
+    static void drainPending() {
+        AutoreleasePoolThreadState *state = threadState();
+        if (state && state->hasPending) {
+            drainPendingEntries(state, {0, 0});
+        }
+    }
+
+    static void setRetentionPolicy(AutoreleasePoolRetentionPolicy policy) {
+        retention = policy;
+    }
+
+    // Pops of at least minEntries entries group the entries by object
+    // and release each object once with their combined count, instead
+    // of releasing entry by entry. Worth it when a few objects make up
+    // most of a large scope. Zero turns it off.
+    static void setCoalescedDrain(size_t minEntries) {
+        coalescedDrainThreshold = minEntries;
+    }
+
+    // Limits are checked only when a page is allocated, so the pool
+    // fast paths never look at them. Set this up before the threads of
+    // interest start.
+    static void setPageBudget(AutoreleasePoolPageBudget budget) {
+        pageBudget = budget;
+    }
+
+    // Pool memory held by all threads, in pages of SIZE, spare pages
+    // and the page cache included.
+    static size_t processPages() {
+        return (size_t)pagesInUse.sum();
+    }
+
+    // Free the current thread's spare pages, i.e. the empty pages above
+    // the hot page that are kept around for re-use, including any that
+    // reserve() set aside. Also drops the table kept for coalesced
+    // drains and the unused scopedAlloc() chunks. Returns the pool
+    // memory freed in pages of SIZE, like reclaimSparePages() and
+    // onMemoryPressure().
+    static size_t trim() {
+        if (AutoreleasePoolThreadState *state = threadState()) {
+            state->reservedDepth = 0;
+            state->reservedScopes.clear();
+            state->drainTable = {};
+            state->arena.trim();
+        }
+        claimSparePages();
+        AutoreleasePoolPage *page = hotPage();
+        if (!page || !page->child) return 0;
+
+        uint32_t pages = threadState()->pageCount.load(std::memory_order_relaxed);
+        size_t units = unitsBelow(pages) - unitsBelow(page->depth + 1);
+        page->child->kill();
+        return units;
+    }
+
+    // Start or stop call-site sampling. Set this up before the threads
+    // of interest start autoreleasing; threads pick up a new period at
+    // their next sample.
+    static void setSampling(AutoreleaseSampleMode mode, uint64_t period) {
+        if (mode == AutoreleaseSampleMode::Off || period == 0) {
+            sampleMode = AutoreleaseSampleMode::Off;
+            samplePeriod = 0;
+        } else {
+            samplePeriod = period;
+            sampleMode = mode;
+        }
+    }
+
+    // Write all samples gathered so far, from live and exited threads,
+    // as folded stacks. Weights are autorelease counts or bytes,
+    // depending on the sampling mode.
+    static void dumpSamples(FILE *out) {
+        std::lock_guard<std::mutex> guard(registryLock);
+        for (AutoreleasePoolThreadState *state = registry; state; state = state->next) {
+            if (AutoreleaseSampleTable *samples = state->samples.load(std::memory_order_acquire)) {
+                samples->printFolded(out);
+            }
+        }
+        if (exitedSamples) exitedSamples->printFolded(out);
+    }
+
+#if TRACK_AUTORELEASEPOOL_SCOPES
+    // Merge the scope histograms of all threads, live and exited, into
+    // `stats`. Threads keep recording while this runs.
+    static void scopeStats(AutoreleasePoolScopeStats *stats) {
+        std::lock_guard<std::mutex> guard(registryLock);
+        for (AutoreleasePoolThreadState *state = registry; state; state = state->next) {
+            stats->merge(*state->scopeStats);
+        }
+        if (exitedScopeStats) stats->merge(*exitedScopeStats);
+    }
+#endif
+
+    // Memory pressure entry point. Call it from the platform's pressure
+    // notification, or directly to simulate pressure.
+    // Returns the number of pages freed immediately, in pages of SIZE.
+    static size_t onMemoryPressure(AutoreleasePoolMemoryPressure level) {
+        if (level == AutoreleasePoolMemoryPressure::Normal) return 0;
+
+        size_t freed = 0;
+        std::lock_guard<std::mutex> guard(registryLock);
+        for (AutoreleasePoolThreadState *state = registry; state; state = state->next) {
+            if (!state->trimRequested.exchange(true, std::memory_order_relaxed)) {
+                threadsWithTrimRequest.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (level == AutoreleasePoolMemoryPressure::Critical) {
+                freed += reclaimSparePages(state);
+            }
+        }
+        return freed;
+    }
+
+    static void init() {
+        environ_init();
+        options = currentOptions();
+        entryPoints = entryPointTable[options];
+
+        // OBJC_DEBUG_POOL_DEPTH takes a page count rather than YES.
+        if (const char *value = getenv("OBJC_DEBUG_POOL_DEPTH")) {
+            long pages = atol(value);
+            if (pages > 0) setPageBudget({(size_t)pages, 0, logPageBudgetOverflow});
+        }
+
+        int r __unused = pthread_key_init_np(AutoreleasePoolPage::key,
+                                             AutoreleasePoolPage::tls_dealloc);
+        ASSERT(r == 0);
+        r = pthread_key_init_np(AutoreleasePoolPage::stateKey,
+                                AutoreleasePoolPage::state_dealloc);
+        ASSERT(r == 0);
+#if SUPPORT_RETURN_AUTORELEASE
+        r = pthread_key_init_np(AutoreleasePoolPage::returnKey,
+                                AutoreleasePoolPage::return_dealloc);
+        ASSERT(r == 0);
+#endif
+    }
+
+    __attribute__((noinline, cold)) void print() {
+        //        _objc_inform("[%p]  ................  PAGE %s %s %s", this,
+        //                     full() ? "(full)" : "",
+        //                     this == hotPage() ? "(hot)" : "",
+        //                     this == coldPage() ? "(cold)" : "");
+        //        check(false);
+        //        for (id *p = begin(); p < next; p++) {
+        //            if (*p == POOL_BOUNDARY) {
+        //                _objc_inform("[%p]  ################  POOL %p", p, p);
+        //            } else {
+        //#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+        //                AutoreleasePoolEntry *entry = (AutoreleasePoolEntry *)p;
+        //                if (entry->count > 0) {
+        //                    id obj = (id)entry->ptr;
+        //                    _objc_inform("[%p]  %#16lx  %s  autorelease count %u",
+        //                                 p, (unsigned long)obj, object_getClassName(obj),
+        //                                 entry->count + 1);
+        //                    goto done;
+        //                }
+        //#endif
+        //                _objc_inform("[%p]  %#16lx  %s",
+        //                             p, (unsigned long)*p, object_getClassName(*p));
+        //            done:;
+        //            }
+        //        }
+    }
+
+    __attribute__((noinline, cold)) static void printAll() {
+        //        _objc_inform("##############");
+        //        _objc_inform("AUTORELEASE POOLS for thread %p", objc_thread_self());
+        //
+        //        AutoreleasePoolPage *page;
+        //        ptrdiff_t objects = 0;
+        //        for (page = coldPage(); page; page = page->child) {
+        //            objects += page->next - page->begin();
+        //        }
+        //        _objc_inform("%llu releases pending.", (unsigned long long)objects);
+        //
+        //        if (haveEmptyPoolPlaceholder()) {
+        //            _objc_inform("[%p]  ................  PAGE (placeholder)",
+        //                         EMPTY_POOL_PLACEHOLDER);
+        //            _objc_inform("[%p]  ################  POOL (placeholder)",
+        //                         EMPTY_POOL_PLACEHOLDER);
+        //        } else {
+        //            for (page = coldPage(); page; page = page->child) {
+        //                page->print();
+        //            }
+        //        }
+        //
+        //        _objc_inform("##############");
+    }
+
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+    __attribute__((noinline, cold)) unsigned sumOfExtraReleases() {
+        unsigned sumOfExtraReleases = 0;
+        for (id *p = begin(); p < next; p++) {
+            if (*p != POOL_BOUNDARY) {
+                sumOfExtraReleases += entryCount(p);
+            }
+        }
+        return sumOfExtraReleases;
+    }
+#endif
+
+    __attribute__((noinline, cold)) static void printHiwat() {
+        // Check and propagate high water mark
+        // Ignore high water marks under 256 to suppress noise.
+        AutoreleasePoolPage *p = hotPage();
+        uint32_t mark = (uint32_t)(capacityBelow(p->depth) + (p->next - p->begin()));
+        if (mark > p->hiwat + 256) {
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+            unsigned sumOfExtraReleases = 0;
+#endif
+            for (; p; p = p->parent) {
+                p->unprotect();
+                p->hiwat = mark;
+                p->protect();
+
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+                sumOfExtraReleases += p->sumOfExtraReleases();
+#endif
+            }
+
+//            _objc_inform("POOL HIGHWATER: new high water mark of %u "
+//                         "pending releases for thread %p:",
+//                         mark, objc_thread_self());
+#if SUPPORT_AUTORELEASEPOOL_DEDUP_PTRS
+            if (sumOfExtraReleases > 0) {
+                //                _objc_inform("POOL HIGHWATER: extra sequential autoreleases of objects: %u",
+                //                             sumOfExtraReleases);
+            }
+#endif
+
+            //            void *stack[128];
+            //            int count = backtrace(stack, sizeof(stack) / sizeof(stack[0]));
+            //            char **sym = backtrace_symbols(stack, count);
+            //            for (int i = 0; i < count; i++) {
+            //                _objc_inform("POOL HIGHWATER:     %s", sym[i]);
+            //            }
+            //            free(sym);
+        }
+    }
+
+#undef POOL_BOUNDARY
+
+  private:
+    static const std::array<EntryPoints, OptCombinations> entryPointTable;
+
+    template <size_t... Opts>
+    static constexpr std::array<EntryPoints, sizeof...(Opts)> makeEntryPointTable(std::index_sequence<Opts...>) {
+        return {{entryPointsFor<Opts>()...}};
+    }
+};
+
+inline RefCountMergeQueue *RefCounted::currentQueue() {
+    AutoreleasePoolThreadState *state = AutoreleasePoolPage::threadState();
+    return state ? state->refCountQueue : nil;
+}
+
+inline RefCountMergeQueue *RefCounted::localQueue() {
+    if (RefCountMergeQueue *queue = currentQueue()) return queue;
+    return AutoreleasePoolPage::installRefCountQueue();
+}
+
+
+#endif /* AutoreleasePoolPage_h */
@@ -0,0 +1,275 @@
+//
+//  scaling.cpp
+//  AutoreleasePoolTest
+//
+//  Push, autorelease and pop throughput from one thread up to every
+//  core, for a few mixes, plus thread churn. Build the library with
+//  LOG_AUTORELEASEPOOL=0.
+//
+//  usage: AutoreleasePoolScaling [threads=N] [entries=N] [depth=N] [ms=N]
+//
+
+#include "AutoreleasePool.h"
+#include <thread>
+
+struct Config {
+    int threads;  // most threads to run
+    int entries;  // autoreleases per innermost pool
+    int depth;    // nested pools per round
+    int ms;       // run time of each measurement
+};
+
+static Config config = {0, 64, 2, 200};
+
+// Objects are made by the thread that autoreleases them, so their
+// reference counts stay thread-local, as in an ordinary worker.
+static int const OBJECTS_PER_THREAD = 256;
+
+struct Run {
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+};
+
+static void waitForStart(Run &run) {
+    run.ready.fetch_add(1);
+    while (!run.go.load(std::memory_order_acquire)) std::this_thread::yield();
+}
+
+static void startAndStop(Run &run, int threads) {
+    while (run.ready.load() < threads) std::this_thread::yield();
+    run.go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::milliseconds(config.ms));
+    run.stop.store(true, std::memory_order_relaxed);
+}
+
+// One round: `depth` nested pools, `entries` autoreleases in the
+// innermost one.
+static void round(const std::vector<Object *> &objects, int entries, int depth, unsigned &pick) {
+    if (depth == 0) {
+        for (int i = 0; i < entries; i++) {
+            Object *object = objects[pick++ % OBJECTS_PER_THREAD];
+            object->retain();
+            autorelease((id)object);
+        }
+        return;
+    }
+    void *token = autoreleasePoolPush();
+    round(objects, entries, depth - 1, pick);
+    autoreleasePoolPop(token);
+}
+
+struct Result {
+    double total;  // autoreleases per microsecond over all threads
+    double min;    // slowest thread, autoreleases per microsecond
+    double max;    // fastest thread
+};
+
+// Every thread runs rounds of the given shape until time is up.
+static Result runMix(int threads, int entries, int depth) {
+    Run run;
+    std::vector<uint64_t> counts(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            std::vector<Object *> objects;
+            for (int i = 0; i < OBJECTS_PER_THREAD; i++) objects.push_back(new Object("scaling"));
+            unsigned pick = 0;
+            // Warm up the thread's pages before the clock starts.
+            round(objects, entries, depth, pick);
+            waitForStart(run);
+            uint64_t rounds = 0;
+            while (!run.stop.load(std::memory_order_relaxed)) {
+                round(objects, entries, depth, pick);
+                rounds++;
+            }
+            counts[t] = rounds * (uint64_t)entries;
+            for (Object *object : objects) object->release();
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    startAndStop(run, threads);
+    for (std::thread &worker : workers) worker.join();
+    double us = (double)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    Result result = {0, 1e300, 0};
+    for (uint64_t count : counts) {
+        double rate = (double)count / us;
+        result.total += rate;
+        result.min = std::min(result.min, rate);
+        result.max = std::max(result.max, rate);
+    }
+    return result;
+}
+
+// Threads that start, autorelease into pools they never pop and exit,
+// leaving tls_dealloc() to release the objects and hand the pages to
+// the page cache. `threads` of them are alive at any time.
+// Returns thread exits per millisecond.
+static double runChurn(int threads) {
+    Run run;
+    std::atomic<uint64_t> exits{0};
+    std::vector<std::thread> spawners;
+    for (int t = 0; t < threads; t++) {
+        spawners.emplace_back([&] {
+            waitForStart(run);
+            while (!run.stop.load(std::memory_order_relaxed)) {
+                std::thread([] {
+                    std::vector<Object *> objects;
+                    for (int i = 0; i < OBJECTS_PER_THREAD; i++) objects.push_back(new Object("churn"));
+                    unsigned pick = 0;
+                    autoreleasePoolPush();
+                    round(objects, config.entries, config.depth, pick);
+                    autoreleasePoolPush();
+                    for (Object *object : objects) autorelease((id)object);
+                }).join();
+                exits.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    startAndStop(run, threads);
+    for (std::thread &spawner : spawners) spawner.join();
+    double ms = (double)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000;
+    return (double)exits.load() / ms;
+}
+
+// A KeepPages limit that no run here reaches.
+static size_t const KEEP_ALL_PAGES = 1 << 20;
+
+// Runs of each case in the page allocation measurement.
+static int const PAGE_RUNS = 5;
+
+// Pages above the cold page that a round of `entries` entries fills,
+// which is what it allocates and frees when pops keep no spare pages.
+// Counted in pages of SIZE, as trim() reports them.
+static size_t pagesPerRound(int entries) {
+    size_t pages = 0;
+    AutoreleasePoolPage::setRetentionPolicy({AutoreleasePoolRetentionPolicy::KeepPages, KEEP_ALL_PAGES});
+    std::thread([&] {
+        std::vector<Object *> objects;
+        for (int i = 0; i < OBJECTS_PER_THREAD; i++) objects.push_back(new Object("pages"));
+        unsigned pick = 0;
+        round(objects, entries, 1, pick);
+        pages = AutoreleasePoolPage::trim();
+        for (Object *object : objects) object->release();
+    }).join();
+    AutoreleasePoolPage::setRetentionPolicy({AutoreleasePoolRetentionPolicy::Hysteresis, 0});
+    return pages;
+}
+
+static void printHeader(const char *title) {
+    printf("\n%s\n%8s %12s %12s %12s %12s %10s\n", title, "threads", "total M/s", "per thread", "slowest", "fastest", "efficiency");
+}
+
+// Scaling efficiency is per-thread throughput relative to one thread.
+static void printRow(int threads, const Result &result, double single) {
+    printf("%8d %12.2f %12.2f %12.2f %12.2f %9.0f%%\n", threads, result.total, result.total / threads, result.min, result.max,
+           100 * result.total / threads / single);
+}
+
+static std::vector<int> threadCounts() {
+    std::vector<int> counts;
+    for (int t = 1; t < config.threads; t *= 2) counts.push_back(t);
+    counts.push_back(config.threads);
+    return counts;
+}
+
+int main(int argc, const char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        int value = 0;
+        if (sscanf(argv[i], "threads=%d", &value) == 1) config.threads = value;
+        else if (sscanf(argv[i], "entries=%d", &value) == 1) config.entries = value;
+        else if (sscanf(argv[i], "depth=%d", &value) == 1) config.depth = value;
+        else if (sscanf(argv[i], "ms=%d", &value) == 1) config.ms = value;
+        else {
+            fprintf(stderr, "usage: %s [threads=N] [entries=N] [depth=N] [ms=N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.threads <= 0) config.threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    if (config.entries <= 0) config.entries = 1;
+    if (config.depth <= 0) config.depth = 1;
+
+    printf("up to %d threads, %d entries per pool, %d nested pools, %d ms per run\n",
+           config.threads, config.entries, config.depth, config.ms);
+
+    // Steady state: every thread keeps its pages, so nothing is shared
+    // but the globals the fast paths read. Per-thread throughput that
+    // drops with more threads points at sharing on those.
+    printHeader("steady state, M autoreleases/s");
+    double single = 0;
+    for (int threads : threadCounts()) {
+        Result result = runMix(threads, config.entries, config.depth);
+        if (threads == 1) single = result.total;
+        printRow(threads, result, single);
+    }
+
+    // The same with threads exiting alongside: exits write the page
+    // cache head, the thread registry and the page counters. A drop
+    // against the steady state is false sharing between those and the
+    // fast paths' globals.
+    printHeader("steady state next to thread churn, M autoreleases/s");
+    for (int threads : threadCounts()) {
+        Run run;
+        std::thread churn([&] {
+            waitForStart(run);
+            while (!run.stop.load(std::memory_order_relaxed)) {
+                std::thread([] {
+                    void *token = autoreleasePoolPush();
+                    autorelease((id) new Object("churn"));
+                    (void)token;
+                }).join();
+            }
+        });
+        // Keep the churn going for the whole measurement.
+        while (run.ready.load() < 1) std::this_thread::yield();
+        run.go.store(true, std::memory_order_release);
+        Result result = runMix(threads, config.entries, config.depth);
+        run.stop.store(true, std::memory_order_relaxed);
+        churn.join();
+        printRow(threads, result, single);
+    }
+
+    // Scopes spanning several pages, run once with every spare page kept
+    // and once with none, so that every round allocates and frees them.
+    // The difference is the allocator's share, which grows with
+    // contention. Hysteresis would free most of them here too: each
+    // round's pop empties the whole chain.
+    int large = 4 * (int)(AutoreleasePoolPage::SIZE / sizeof(id));
+    size_t pages = pagesPerRound(large);
+    printf("\npage allocation, %d autoreleases and %zu pages of %zu bytes per round\n%8s %14s %14s %14s\n",
+           large, pages, (size_t)AutoreleasePoolPage::SIZE, "threads", "kept M/s", "freed M/s", "ns per page");
+    for (int threads : threadCounts()) {
+        // The pages are a small part of a round, so the two runs are
+        // alternated and each keeps its best, which is the least noisy.
+        Result kept = {0, 0, 0};
+        Result freed = {0, 0, 0};
+        for (int i = 0; i < PAGE_RUNS; i++) {
+            AutoreleasePoolPage::setRetentionPolicy({AutoreleasePoolRetentionPolicy::KeepPages, KEEP_ALL_PAGES});
+            Result result = runMix(threads, large, 1);
+            if (result.total > kept.total) kept = result;
+            AutoreleasePoolPage::setRetentionPolicy({AutoreleasePoolRetentionPolicy::KeepPages, 0});
+            result = runMix(threads, large, 1);
+            if (result.total > freed.total) freed = result;
+        }
+        AutoreleasePoolPage::setRetentionPolicy({AutoreleasePoolRetentionPolicy::Hysteresis, 0});
+        // Per-thread time per round, in ns, with and without allocating.
+        // A freed run no slower than the kept one is below the noise.
+        double keptNs = 1000 * large / (kept.total / threads);
+        double freedNs = 1000 * large / (freed.total / threads);
+        if (pages && freedNs > keptNs) {
+            printf("%8d %14.2f %14.2f %14.1f\n", threads, kept.total, freed.total, (freedNs - keptNs) / (double)pages);
+        } else {
+            printf("%8d %14.2f %14.2f %14s\n", threads, kept.total, freed.total, "noise");
+        }
+    }
+
+    // Threads that exit with pools still open.
+    printf("\nthread churn, exits with live pools\n%8s %14s %14s\n", "threads", "exits/ms", "per thread");
+    for (int threads : threadCounts()) {
+        double rate = runChurn(threads);
+        printf("%8d %14.2f %14.2f\n", threads, rate, rate / threads);
+    }
+    return 0;
+}